@@ -1,4 +1,5 @@
 import argparse
+import struct
 import paho.mqtt.client as mqtt
 import matplotlib.pyplot as plt
 from matplotlib.animation import FuncAnimation
@@ -6,8 +7,28 @@ import numpy as np
 from collections import deque
 from scipy import stats
 
+# Magnetometer stream chunk, see publish_mag_stream() in src/publish/publish.c
+MAG_STREAM_VERSION = 1
+MAG_STREAM_LAST = 0x01
+MAG_STREAM_HEADER = struct.Struct("<BBBB")
+MAG_STREAM_SAMPLE = struct.Struct("<Ifff")
+SAMPLE_PERIOD_MS = 100
+
+
+def decode_mag_stream(payload):
+    version, duck_id, count, flags = MAG_STREAM_HEADER.unpack_from(payload, 0)
+    if version != MAG_STREAM_VERSION:
+        raise ValueError(f"Unknown mag stream version {version}")
+    samples = [
+        MAG_STREAM_SAMPLE.unpack_from(
+            payload, MAG_STREAM_HEADER.size + i * MAG_STREAM_SAMPLE.size
+        )
+        for i in range(count)
+    ]
+    return samples, bool(flags & MAG_STREAM_LAST)
+
 
-def main(device_id):
+def main(device_id, duration_s, calibrate, broker):
     # Initialize data lists with a maximum length
     max_points = 1000
     x_data, y_data, z_data = (
@@ -46,22 +67,33 @@ def main(device_id):
     # Variables for center calculation
     center_x, center_y = 0, 0
     update_counter = 0
+    last_tick_ms = None
+    missed_samples = 0
 
     # MQTT callback functions
     def on_connect(client, userdata, flags, rc, properties=None):
         print("Connected with result code " + str(rc))
-        client.subscribe(f"dancing_duck/devices/{device_id}/sensor/mag")
+        client.subscribe(f"dancing_duck/devices/{device_id}/sensor/mag/stream", qos=1)
+        command_root = f"dancing_duck/devices/{device_id}/command"
+        # The duck streams every sample it reads, the same ones its Kasa fit uses
+        client.publish(f"{command_root}/mag_stream", str(duration_s))
+        if calibrate:
+            client.publish(f"{command_root}/calibrate", "")
 
     def on_message(client, userdata, msg):
-        payload = msg.payload.decode()
-        values = payload.split(", ")
-        x = float(values[0].split(": ")[1])
-        y = float(values[1].split(": ")[1])
-        z = float(values[2].split(": ")[1])
-
-        x_data.append(x)
-        y_data.append(y)
-        z_data.append(z)
+        nonlocal last_tick_ms, missed_samples
+        samples, last = decode_mag_stream(msg.payload)
+        for tick_ms, x, y, z in samples:
+            if last_tick_ms is not None:
+                gap = round((tick_ms - last_tick_ms) / SAMPLE_PERIOD_MS)
+                missed_samples += max(0, gap - 1)
+            last_tick_ms = tick_ms
+
+            x_data.append(x)
+            y_data.append(y)
+            z_data.append(z)
+        if last:
+            print(f"Stream ended, {len(x_data)} samples, {missed_samples} missed")
 
     def fit_circle_with_confidence(x, y):
         x = np.array(x)
@@ -190,7 +222,7 @@ def main(device_id):
     client.on_message = on_message
 
     # Connect to MQTT broker
-    client.connect("192.168.1.1", 1883, 60)
+    client.connect(broker, 1883, 60)
 
     # Start MQTT loop in a separate thread
     client.loop_start()
@@ -210,8 +242,20 @@ def main(device_id):
 
 if __name__ == "__main__":
     parser = argparse.ArgumentParser(
-        description="A script that takes a device_id integer argument"
+        description="Stream a duck's raw magnetometer samples and fit a circle to them"
     )
     parser.add_argument("device_id", type=int, help="An integer argument for device_id")
+    parser.add_argument(
+        "-d", "--duration", type=int, default=30, help="Seconds to stream, up to 120"
+    )
+    parser.add_argument(
+        "-c",
+        "--calibrate",
+        action="store_true",
+        help="Also start a calibration on the duck",
+    )
+    parser.add_argument(
+        "-b", "--broker", default="192.168.1.1", help="MQTT broker address"
+    )
     args = parser.parse_args()
-    main(args.device_id)
+    main(args.device_id, args.duration, args.calibrate, args.broker)
@@ -0,0 +1,239 @@
+import argparse
+import json
+import struct
+import sys
+import threading
+
+import paho.mqtt.client as mqtt
+
+# Trace chunk, see src/trace/trace.h
+TRACE_CHUNK_VERSION = 1
+TRACE_CHUNK_LAST = 0x01
+TRACE_CHUNK_HEADER = struct.Struct("<BBBB")
+TRACE_RECORD = struct.Struct("<IBBBxI")
+
+# Mirrors enum TracePhase and enum TraceSpan
+TRACE_BEGIN, TRACE_END, TRACE_SWITCH_IN = range(3)
+SPAN_NAMES = [
+    "motor_loop",
+    "mag_read",
+    "mqtt_inpub_cb",
+    "mqtt_data_cb",
+    "command",
+    "publish_slot",
+]
+CORES = 2
+
+
+def decode_trace_chunk(payload):
+    version, duck_id, flags, count = TRACE_CHUNK_HEADER.unpack_from(payload, 0)
+    if version != TRACE_CHUNK_VERSION:
+        raise ValueError(f"Unknown trace chunk version {version}")
+    records = [
+        TRACE_RECORD.unpack_from(
+            payload, TRACE_CHUNK_HEADER.size + i * TRACE_RECORD.size
+        )
+        for i in range(count)
+    ]
+    return duck_id, records, bool(flags & TRACE_CHUNK_LAST)
+
+
+def parse_task_names(text):
+    names = {}
+    for line in text.splitlines():
+        number, _, name = line.strip().partition(" ")
+        if number.isdigit():
+            names[int(number)] = name
+    return names
+
+
+def capture_mqtt(device_id, broker, timeout_s):
+    chunks = []
+    task_text = []
+    done = threading.Event()
+    device_root = f"dancing_duck/devices/{device_id}"
+
+    def on_connect(client, userdata, flags, rc, properties=None):
+        client.subscribe(f"{device_root}/trace", qos=1)
+        client.subscribe(f"{device_root}/trace/tasks", qos=1)
+        client.publish(f"{device_root}/command/trace_dump", "")
+
+    def on_message(client, userdata, msg):
+        if msg.topic.endswith("/tasks"):
+            task_text.append(msg.payload.decode())
+            return
+        chunks.append(msg.payload)
+        if decode_trace_chunk(msg.payload)[2]:
+            done.set()
+
+    client = mqtt.Client(mqtt.CallbackAPIVersion.VERSION2)
+    client.on_connect = on_connect
+    client.on_message = on_message
+    client.connect(broker, 1883, 60)
+    client.loop_start()
+    if not done.wait(timeout_s):
+        print(
+            f"Dump incomplete after {timeout_s} s, {len(chunks)} chunks",
+            file=sys.stderr,
+        )
+    client.loop_stop()
+    client.disconnect()
+    return chunks, "".join(task_text)
+
+
+def read_uart_log(path):
+    # print_trace_chunk() lines, anything else in the log is skipped
+    chunks = []
+    task_lines = []
+    in_tasks = False
+    with open(path) as f:
+        for line in f:
+            line = line.strip()
+            if line.startswith("TRACE "):
+                chunks.append(bytes.fromhex(line[len("TRACE ") :]))
+            elif line == "TRACE_TASKS":
+                in_tasks = True
+            elif line == "TRACE_END":
+                in_tasks = False
+            elif in_tasks:
+                task_lines.append(line)
+    return chunks, "\n".join(task_lines)
+
+
+def unwrap_times(records_by_core):
+    # time_us wraps every 71 minutes, each core's records are in order
+    first = None
+    for core, records in records_by_core.items():
+        offset = 0
+        last = None
+        unwrapped = []
+        for time_us, phase, span, arg in records:
+            if last is not None and time_us < last:
+                offset += 1 << 32
+            last = time_us
+            unwrapped.append((time_us + offset, phase, span, arg))
+        # Keep both cores on one timeline when only one of them saw the wrap
+        if unwrapped:
+            if first is None:
+                first = unwrapped[0][0]
+            shift = round((first - unwrapped[0][0]) / (1 << 32)) << 32
+            unwrapped = [(t + shift, p, s, a) for t, p, s, a in unwrapped]
+        records_by_core[core] = unwrapped
+
+
+def to_chrome_trace(chunks, task_names):
+    records_by_core = {core: [] for core in range(CORES)}
+    duck_id = 0
+    for chunk in chunks:
+        duck_id, records, _ = decode_trace_chunk(chunk)
+        for time_us, core, phase, span, arg in records:
+            records_by_core[core].append((time_us, phase, span, arg))
+    unwrap_times(records_by_core)
+
+    starts = [r[0][0] for r in records_by_core.values() if r]
+    origin = min(starts) if starts else 0
+    events = [
+        {
+            "ph": "M",
+            "pid": duck_id,
+            "name": "process_name",
+            "args": {"name": f"duck {duck_id}"},
+        }
+    ]
+
+    for core, records in records_by_core.items():
+        task_tid = core * 2
+        span_tid = core * 2 + 1
+        track_names = (
+            (task_tid, f"core {core} tasks"),
+            (span_tid, f"core {core} spans"),
+        )
+        for tid, name in track_names:
+            events.append(
+                {
+                    "ph": "M",
+                    "pid": duck_id,
+                    "tid": tid,
+                    "name": "thread_name",
+                    "args": {"name": name},
+                }
+            )
+
+        # A task runs from its switch in to the next switch in on the same core
+        switches = [
+            (t, arg) for t, phase, _, arg in records if phase == TRACE_SWITCH_IN
+        ]
+        for (start, task), (end, _) in zip(switches, switches[1:]):
+            events.append(
+                {
+                    "ph": "X",
+                    "pid": duck_id,
+                    "tid": task_tid,
+                    "name": task_names.get(task, f"task {task}"),
+                    "ts": start - origin,
+                    "dur": end - start,
+                }
+            )
+
+        # Ends whose begin was overwritten and begins still open are dropped
+        open_spans = {}
+        for t, phase, span, arg in records:
+            if phase == TRACE_BEGIN:
+                open_spans[span] = (t, arg)
+            elif phase == TRACE_END and span in open_spans:
+                start, begin_arg = open_spans.pop(span)
+                if span < len(SPAN_NAMES):
+                    name = SPAN_NAMES[span]
+                else:
+                    name = f"span {span}"
+                events.append(
+                    {
+                        "ph": "X",
+                        "pid": duck_id,
+                        "tid": span_tid,
+                        "name": name,
+                        "ts": start - origin,
+                        "dur": t - start,
+                        "args": {"arg": begin_arg},
+                    }
+                )
+
+    return {"traceEvents": events, "displayTimeUnit": "ms"}
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Dump a duck's trace recorder and convert it for ui.perfetto.dev"
+    )
+    parser.add_argument(
+        "device_id", type=int, nargs="?", help="Duck to dump over MQTT"
+    )
+    parser.add_argument(
+        "-u", "--uart-log", help="Convert a UART log of trace_dump uart instead"
+    )
+    parser.add_argument(
+        "-b", "--broker", default="192.168.1.1", help="MQTT broker address"
+    )
+    parser.add_argument(
+        "-t", "--timeout", type=float, default=10.0, help="Seconds to wait"
+    )
+    parser.add_argument(
+        "-o", "--output", default="trace.json", help="Chrome trace JSON file"
+    )
+    args = parser.parse_args()
+
+    if args.uart_log:
+        chunks, task_text = read_uart_log(args.uart_log)
+    elif args.device_id is not None:
+        chunks, task_text = capture_mqtt(args.device_id, args.broker, args.timeout)
+    else:
+        parser.error("Give a device_id or --uart-log")
+
+    trace = to_chrome_trace(chunks, parse_task_names(task_text))
+    with open(args.output, "w") as f:
+        json.dump(trace, f)
+    print(f"Wrote {len(trace['traceEvents'])} events to {args.output}")
+
+
+if __name__ == "__main__":
+    main()
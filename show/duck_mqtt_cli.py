@@ -2,10 +2,14 @@ import argparse
 import json
 import paho.mqtt.client as mqtt
 import os
+import struct
 import sys
+import threading
 import time
 from enum import IntEnum
 
+from motor_codec import encode_motor_command, encode_motor_sequence
+
 
 class MotorCommandType(IntEnum):
     MOTOR = 0
@@ -75,6 +79,87 @@ def on_publish(client, userdata, mid, reason_code=None, properties=None):
     pass  # Do nothing, effectively removing the MID printout
 
 
+# Sender number for sequenced commands, each sender keeps its own window on the duck (max 8)
+CLI_SENDER_ID = 1
+SEQUENCED_COMMANDS = ["launch", "motor", "sequence"]
+
+
+def next_sequence_number():
+    """Epoch milliseconds, so numbers keep increasing across CLI runs, 0 is unsequenced"""
+    return (int(time.time() * 1000) & 0xFFFFFFFF) or 1
+
+
+def sequence_number(args):
+    """Reuse --seq on a retry, a duck that already ran the command only acks it"""
+    if args.seq is None:
+        return next_sequence_number()
+    if not 0 < args.seq <= 0xFFFFFFFF:
+        raise ValueError("--seq must be between 1 and 4294967295")
+    return args.seq
+
+
+class AckCollector:
+    """Collects acks and execution events from every duck for one sequence number."""
+
+    ACK_STATUS = {0: "rejected", 1: "accepted", 2: "duplicate", 3: "stale"}
+
+    def __init__(self, client):
+        self.lock = threading.Lock()
+        self.subscribed = threading.Event()
+        self.acks = {}
+        self.executed = set()
+        self.seq = None
+        client.on_message = self.on_message
+        client.on_subscribe = self.on_subscribe
+        client.subscribe(
+            [("dancing_duck/devices/+/ack/#", 0), ("dancing_duck/devices/+/event/#", 0)]
+        )
+        if not self.subscribed.wait(5):
+            raise Exception("Subscribe timeout")
+
+    def on_subscribe(self, client, userdata, mid, reason_codes, properties=None):
+        self.subscribed.set()
+
+    def on_message(self, client, userdata, message):
+        # dancing_duck/devices/<id>/ack/<command> or dancing_duck/devices/<id>/event/executed
+        parts = message.topic.split("/")
+        try:
+            device_id = int(parts[2])
+            payload = json.loads(message.payload.decode("utf-8").rstrip("\0"))
+        except (IndexError, ValueError):
+            return
+        with self.lock:
+            if payload.get("src") != CLI_SENDER_ID or payload.get("seq") != self.seq:
+                return
+            if parts[3] == "event":
+                self.executed.add(device_id)
+            else:
+                self.acks[device_id] = self.ACK_STATUS.get(payload.get("status"), "unknown")
+
+    def wait(self, expected, timeout_s=3.0):
+        """Wait for an ack from each expected duck, None when the set is unknown (groups)"""
+        deadline = time.time() + timeout_s
+        while time.time() < deadline:
+            with self.lock:
+                if expected is not None and all(d in self.acks for d in expected):
+                    break
+            time.sleep(0.05)
+
+        with self.lock:
+            for device_id in sorted(self.acks):
+                started = ", executing" if device_id in self.executed else ""
+                print(f"Device {device_id}: {self.acks[device_id]}{started}")
+            if expected is not None:
+                missing = [d for d in expected if d not in self.acks]
+                if missing:
+                    print(
+                        f"No ack from devices: {missing}, "
+                        f"resend with --seq {self.seq} to retry"
+                    )
+                return not missing
+            return bool(self.acks)
+
+
 def create_motor_message(motor_type, config, **kwargs):
     if motor_type == MotorCommandType.MOTOR:
         return {
@@ -115,20 +200,45 @@ def create_return_message(config):
     }
 
 
+def command_topic(device_id, command):
+    if device_id == "all":
+        return f"dancing_duck/all_devices/command/{command}"
+    if is_group(device_id):
+        return f"dancing_duck/groups/{device_id[1:]}/command/{command}"
+    return f"dancing_duck/devices/{device_id}/command/{command}"
+
+
 def send_command(client, device_id, command, config, **kwargs):
-    topic = f"dancing_duck/devices/{device_id}/command/{command}"
+    binary = kwargs.pop("binary", False)
+    # Sequenced commands are confirmed by their ack, so publishing does not wait per duck
+    seq = kwargs.pop("seq", 0)
+    if command == "motor" and binary:
+        command = "motor/bin"
+
+    topic = command_topic(device_id, command)
 
     if command in ["calibrate", "dance", "stop_all", "reset"]:
         message = None  # No message for these commands
     elif command == "launch":
-        message = json.dumps(
-            {"launch_time": kwargs.get("launch_time"), "heading": kwargs.get("heading")}
-        )
+        launch = {"launch_time": kwargs.get("launch_time"), "heading": kwargs.get("heading")}
+        if seq:
+            launch.update({"src": CLI_SENDER_ID, "seq": seq})
+        message = json.dumps(launch)
     elif command == "motor":
         motor_type = kwargs.pop("motor_type", None)  # Remove motor_type from kwargs
         if motor_type is None:
             raise ValueError("Motor type is required for motor command")
-        message = json.dumps(create_motor_message(motor_type, config, **kwargs))
+        motor = create_motor_message(motor_type, config, **kwargs)
+        if seq:
+            motor.update({"src": CLI_SENDER_ID, "seq": seq})
+        message = json.dumps(motor)
+    elif command == "motor/bin":
+        motor_type = kwargs.pop("motor_type", None)  # Remove motor_type from kwargs
+        if motor_type is None:
+            raise ValueError("Motor type is required for motor command")
+        message = encode_motor_command(
+            create_motor_message(motor_type, config, **kwargs), CLI_SENDER_ID, seq
+        )
     elif command == "return":
         message = json.dumps(create_return_message(config))
     else:
@@ -136,10 +246,16 @@ def send_command(client, device_id, command, config, **kwargs):
 
     # Print the topic and message
     print(f"Publishing to topic: {topic}")
-    print(f"Message content: {message}")
+    if isinstance(message, bytes):
+        print(f"Message content: {message.hex()} ({len(message)} bytes)")
+    else:
+        print(f"Message content: {message}")
 
-    qos = 0
+    qos = 1 if seq else 0
     result = client.publish(topic, message, qos=qos)
+    if seq:
+        print(f"{command.capitalize()} command {seq} queued for device: {device_id}")
+        return
     result.wait_for_publish()
     print(f"{command.capitalize()} command sent to device: {device_id}")
     if command == "return":
@@ -211,6 +327,116 @@ def send_wind_correction_command(client, command, **kwargs):
     print(f"{command.capitalize()} command sent")
 
 
+CHOREOGRAPHY_FORMAT_VERSION = 1
+MOVE_FLAG_RANDOM_HEADING = 0x01
+
+
+def encode_dance_move(move):
+    motor_type = MotorCommandType[move["type"].upper()]
+    flags = 0
+    heading_ddeg = 0
+    heading = move.get("heading", 0)
+    if heading == "random":
+        flags |= MOVE_FLAG_RANDOM_HEADING
+    else:
+        heading_ddeg = int(round((heading % 360) * 10))
+    # The firmware rejects the whole table if any move rounds to zero
+    duration_ds = int(round(move["dur_ms"] / 100))
+    if not 0 < duration_ds <= 0xFFFF:
+        raise ValueError(
+            f"Dance move dur_ms {move['dur_ms']} must round to 1-65535 steps of 100 ms."
+        )
+    return struct.pack(
+        "<BBHhhh",
+        motor_type,
+        flags,
+        duration_ds,
+        int(round(move.get("duty_right", 0) * 1000)),
+        int(round(move.get("duty_left", 0) * 1000)),
+        heading_ddeg,
+    )
+
+
+def encode_choreography(routines):
+    payload = struct.pack("<BB", CHOREOGRAPHY_FORMAT_VERSION, len(routines))
+    for routine in routines:
+        payload += struct.pack("<B", len(routine["moves"]))
+        for move in routine["moves"]:
+            payload += encode_dance_move(move)
+    return payload
+
+
+def fnv1a_hash(data):
+    hash = 2166136261
+    for byte in data:
+        hash = ((hash ^ byte) * 16777619) & 0xFFFFFFFF
+    return hash or 1  # 0 is reserved for the built-in routines
+
+
+def send_choreography_command(client, config):
+    topic = "dancing_duck/all_devices/command/choreography"
+    payload = encode_choreography(config["dance_routines"])
+
+    print(f"Publishing to topic: {topic}")
+    print(f"Routines: {len(config['dance_routines'])}, Bytes: {len(payload)}")
+    print(f"Choreography hash: {fnv1a_hash(payload)} (compare to metric/choreography_hash)")
+
+    result = client.publish(topic, payload, qos=1)
+    result.wait_for_publish()
+    print("Choreography command sent")
+
+
+def create_sequence_move(move, config):
+    motor_type = move["type"]
+    if isinstance(motor_type, str):
+        motor_type = MotorCommandType[motor_type.upper()]
+    message = create_motor_message(motor_type, config, **move)
+    message["start_ms"] = move.get("start_ms", 0)
+    return message
+
+
+def send_sequence_command(client, device_id, sequence_file, config, seq=0):
+    with open(sequence_file, "r") as f:
+        moves = json.load(f)
+    payload = encode_motor_sequence(
+        [create_sequence_move(m, config) for m in moves], CLI_SENDER_ID, seq
+    )
+
+    topic = command_topic(device_id, "sequence")
+
+    print(f"Publishing to topic: {topic}")
+    print(f"Moves: {len(moves)}, Bytes: {len(payload)}")
+
+    result = client.publish(topic, payload, qos=1)
+    if seq:
+        print(f"Sequence command {seq} queued")
+        return
+    print("Check dancing_duck/devices/<n>/ack/sequence for the result")
+    result.wait_for_publish()
+    print("Sequence command sent")
+
+
+MAX_GROUPS = 32
+
+
+def send_groups_command(client, device_id, groups):
+    mask = 0
+    for group in groups:
+        if not 0 <= group < MAX_GROUPS:
+            raise ValueError(f"Group must be between 0 and {MAX_GROUPS - 1}")
+        mask |= 1 << group
+
+    topic = command_topic(device_id, "groups")
+    message = json.dumps({"mask": mask})
+
+    print(f"Publishing to topic: {topic}")
+    print(f"Message content: {message}")
+
+    result = client.publish(topic, message, qos=1)
+    result.wait_for_publish()
+    print(f"Groups {groups} set on device: {device_id}, check ack/groups")
+
+
 def parse_arguments():
     parser = argparse.ArgumentParser(
         description="Send MQTT commands to dancing duck devices"
@@ -222,7 +448,8 @@ def parse_arguments():
         "device", help="Send command to a specific device or all devices"
     )
     device_parser.add_argument(
-        "device", help="Device ID to send command to, or 'all' for all devices"
+        "device",
+        help="Device ID to send command to, 'all' for all devices, or g<n> for group n",
     )
     device_parser.add_argument(
         "action",
@@ -284,6 +511,21 @@ def parse_arguments():
         metavar="MS",
         help="Duration (required for all motor commands)",
     )
+    device_parser.add_argument(
+        "--binary",
+        action="store_true",
+        help="Send motor commands in the compact binary encoding",
+    )
+    device_parser.add_argument(
+        "--confirm",
+        action="store_true",
+        help="Number launch and motor commands, publish to all ducks, then wait for acks",
+    )
+    device_parser.add_argument(
+        "--seq",
+        type=int,
+        help="Resend a confirmed command with the sequence number it was given",
+    )
 
     # Wind correction commands (shortened)
     wind_on = subparsers.add_parser("wind_on", help="Enable wind correction")
@@ -299,6 +541,40 @@ def parse_arguments():
 
     subparsers.add_parser("wind_off", help="Disable wind correction")
 
+    subparsers.add_parser(
+        "choreography", help="Load dance_routines from config onto all devices"
+    )
+
+    sequence_parser = subparsers.add_parser(
+        "sequence", help="Send a list of motor moves, applied as one unit"
+    )
+    sequence_parser.add_argument(
+        "device",
+        help="Device ID to send the sequence to, 'all' for all devices, or g<n> for group n",
+    )
+    sequence_parser.add_argument(
+        "file",
+        help="JSON list of moves, same fields as motor commands plus optional start_ms",
+    )
+    sequence_parser.add_argument(
+        "--confirm",
+        action="store_true",
+        help="Number the sequence and wait for acks instead of each publish",
+    )
+    sequence_parser.add_argument(
+        "--seq",
+        type=int,
+        help="Resend a confirmed sequence with the sequence number it was given",
+    )
+
+    groups_parser = subparsers.add_parser(
+        "groups", help="Set the groups a device belongs to, saved on the device"
+    )
+    groups_parser.add_argument("device", type=int, help="Device ID")
+    groups_parser.add_argument(
+        "groups", type=int, nargs="*", help="Group numbers, none to leave all groups"
+    )
+
     parser.add_argument(
         "--broker", metavar="IP", help="MQTT broker IP address (optional)"
     )
@@ -306,13 +582,30 @@ def parse_arguments():
     return parser.parse_args()
 
 
+def is_group(device_id):
+    return isinstance(device_id, str) and device_id.startswith("g")
+
+
+def expected_acks(device, config):
+    """Ducks that should ack a command sent to device, None for a group"""
+    if device == "all":
+        return config.get("device_ids", [])
+    if is_group(device):
+        return None
+    return [device]
+
+
 def validate_device(device):
     if device.lower() == "all":
         return "all"
     try:
+        if device.lower().startswith("g"):
+            return f"g{int(device[1:])}"
         return int(device)
     except ValueError:
-        raise argparse.ArgumentTypeError("Device must be a positive integer or 'all'")
+        raise argparse.ArgumentTypeError(
+            "Device must be a positive integer, 'all', or g<n> for a group"
+        )
 
 
 def validate_arguments(args, config):
@@ -417,13 +710,26 @@ def main():
             command_args = {
                 k: v
                 for k, v in vars(args).items()
-                if k not in ["command", "device", "action"]
+                if k not in ["command", "device", "action", "confirm", "seq"]
             }
-            if device == "all":
+            collector = None
+            confirm = args.confirm or args.seq is not None
+            if confirm and args.action in SEQUENCED_COMMANDS:
+                collector = AckCollector(client)
+                collector.seq = command_args["seq"] = sequence_number(args)
+            if device == "all" and args.action == "stop_all":
+                # One publish reaches every duck, no per duck delay
+                send_command(client, "all", args.action, config, **command_args)
+            elif is_group(device):
+                # The broker fans a group command out to every member
+                send_command(client, device, args.action, config, **command_args)
+            elif device == "all":
                 for device_id in config.get("device_ids", []):
                     send_command(client, device_id, args.action, config, **command_args)
             else:
                 send_command(client, device, args.action, config, **command_args)
+            if collector and not collector.wait(expected_acks(device, config)):
+                sys.exit(1)
         elif args.command == "wind_on":
             validate_wind_on_arguments(args)
             command_args = {
@@ -434,6 +740,20 @@ def main():
             send_wind_correction_command(client, args.command, **command_args)
         elif args.command == "wind_off":
             send_wind_correction_command(client, args.command)
+        elif args.command == "choreography":
+            send_choreography_command(client, config)
+        elif args.command == "groups":
+            send_groups_command(client, args.device, args.groups)
+        elif args.command == "sequence":
+            device = validate_device(args.device)
+            if args.confirm or args.seq is not None:
+                collector = AckCollector(client)
+                collector.seq = sequence_number(args)
+                send_sequence_command(client, device, args.file, config, collector.seq)
+                if not collector.wait(expected_acks(device, config)):
+                    sys.exit(1)
+            else:
+                send_sequence_command(client, device, args.file, config)
 
     except Exception as e:
         print(f"Error: {e}")
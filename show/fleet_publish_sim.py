@@ -0,0 +1,91 @@
+import argparse
+import random
+from collections import Counter
+
+# Mirrors the publish schedule in src/publish/publish.c
+SLOT_MS = 50
+FAST_PERIOD_SLOTS = 20
+SLOW_PERIOD_SLOTS = 100
+
+# Rough sizes on the wire, MQTT header and topic included
+FAST_BYTES = 90  # 1 Hz binary record
+SLOW_BYTES = 600  # Text frame of one of the two slow groups
+
+
+def old_schedule(duck_id, duration_ms, rng, args):
+    # Counted from boot, each tick is 100 ms plus the time spent publishing
+    start_ms = rng.uniform(0, args.boot_spread_ms) + rng.uniform(*args.connect_ms) + 1000
+    tick_ms = 100 + args.work_ms
+    count = 0
+    t = start_ms
+    while t < duration_ms:
+        if count % 10 == 0:
+            yield t, FAST_BYTES
+        if (count + 25) % 50 == 0:
+            yield t, SLOW_BYTES
+        count += 1
+        t += tick_ms
+
+
+def new_schedule(duck_id, duration_ms, rng, args):
+    # Slots on server time, so only the clock error moves a duck off its slot
+    fast_slot = duck_id % FAST_PERIOD_SLOTS
+    slow_slot = (duck_id * 21 + 10) % SLOW_PERIOD_SLOTS
+    clock_error_ms = rng.uniform(-args.clock_error_ms, args.clock_error_ms)
+    for slot in range(int(duration_ms // SLOT_MS)):
+        t = slot * SLOT_MS + clock_error_ms + args.work_ms
+        if slot % FAST_PERIOD_SLOTS == fast_slot:
+            yield t, FAST_BYTES
+        if slot % SLOW_PERIOD_SLOTS == slow_slot:
+            yield t, SLOW_BYTES
+
+
+def simulate(schedule, args):
+    rng = random.Random(args.seed)
+    duration_ms = args.minutes * 60 * 1000
+    packets = Counter()
+    volume = Counter()
+    for duck_id in range(1, args.ducks + 1):
+        for t, size in schedule(duck_id, duration_ms, rng, args):
+            window = int(t // args.window_ms)
+            packets[window] += 1
+            volume[window] += size
+    return packets, volume
+
+
+def report(name, packets, volume, args):
+    windows = int(args.minutes * 60 * 1000 // args.window_ms)
+    counts = sorted(packets[w] for w in range(windows))
+    busy = sum(1 for c in counts if c > 1)
+    print(f"{name}:")
+    print(f"  Publishes per {args.window_ms} ms window, "
+          f"p50 {counts[windows // 2]} p99 {counts[int(windows * 0.99)]} max {counts[-1]}")
+    print(f"  Windows with more than one publish: {100.0 * busy / windows:.1f}%")
+    print(f"  Largest burst: {max(volume.values())} bytes")
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Compare the fleet's publish bursts for the old and the staggered schedule"
+    )
+    parser.add_argument("--ducks", type=int, default=10, help="Number of ducks, IDs from 1")
+    parser.add_argument("--minutes", type=float, default=10.0, help="Simulated time")
+    parser.add_argument("--window-ms", type=int, default=20, help="Airtime window")
+    parser.add_argument("--boot-spread-ms", type=float, default=200.0,
+                        help="Spread of power on times, the whole fleet is switched on together")
+    parser.add_argument("--connect-ms", type=float, nargs=2, default=(2000.0, 2200.0),
+                        help="Range of the time from boot to the first publish")
+    parser.add_argument("--work-ms", type=float, default=1.0, help="Time spent publishing a tick")
+    parser.add_argument("--clock-error-ms", type=float, default=5.0,
+                        help="Largest error of a duck's server time")
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+
+    old_packets, old_volume = simulate(old_schedule, args)
+    new_packets, new_volume = simulate(new_schedule, args)
+    report("Boot relative (old)", old_packets, old_volume, args)
+    report("Staggered by duck ID (new)", new_packets, new_volume, args)
+
+
+if __name__ == "__main__":
+    main()
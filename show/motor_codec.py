@@ -0,0 +1,49 @@
+import struct
+
+# Must match the binary motor command layout in src/commanding/motor_binary.c
+MOTOR_COMMAND_BINARY_VERSION = 1
+MOTOR_COMMAND_SEQUENCED_VERSION = 2  # Sender and sequence number for acks and dedupe
+MOTOR_COMMAND_FORMAT = "<HBBfffffI"
+
+
+def encode_motor_command(message, src=0, seq=0):
+    """Pack a motor command dict, as sent on the JSON motor topic, into the binary layout.
+
+    A non-zero seq selects version 2, which the duck acks and executes only once.
+    """
+    payload = struct.pack(
+        MOTOR_COMMAND_FORMAT,
+        MOTOR_COMMAND_SEQUENCED_VERSION if seq else MOTOR_COMMAND_BINARY_VERSION,
+        int(message["type"]),
+        src if seq else 0,
+        message.get("duty_right") or 0.0,
+        message.get("duty_left") or 0.0,
+        message.get("heading") or 0.0,
+        message.get("Kp") or 0.0,
+        message.get("Kd") or 0.0,
+        int(message["dur_ms"]),
+    )
+    if seq:
+        payload += struct.pack("<I", seq)
+    return payload
+
+
+# Must match the motor sequence layout in src/commanding/motor_binary.c
+MOTOR_SEQUENCE_VERSION = 1
+MOTOR_SEQUENCE_SEQUENCED_VERSION = 2
+MOTOR_SEQUENCE_MAX_COMMANDS = 16  # MOTOR_QUEUE_DEPTH, including FLOAT gaps before start times
+
+
+def encode_motor_sequence(moves, src=0, seq=0):
+    """Pack motor command dicts into one sequence, start_ms is optional on each move.
+
+    src and seq go in the header, the duck acks and reports the whole sequence once.
+    """
+    if seq:
+        payload = struct.pack("<BBBI", MOTOR_SEQUENCE_SEQUENCED_VERSION, len(moves), src, seq)
+    else:
+        payload = struct.pack("<BB", MOTOR_SEQUENCE_VERSION, len(moves))
+    for move in moves:
+        payload += struct.pack("<I", int(move.get("start_ms", 0)))
+        payload += encode_motor_command(move)
+    return payload
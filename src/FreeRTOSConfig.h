@@ -81,7 +81,7 @@
 #define configUSE_DAEMON_TASK_STARTUP_HOOK      0
 
 /* Run time and task stats gathering related definitions. */
-#define configGENERATE_RUN_TIME_STATS           0
+#define configGENERATE_RUN_TIME_STATS           1
 #define configUSE_TRACE_FACILITY                1
 #define configUSE_STATS_FORMATTING_FUNCTIONS    0
 
@@ -135,7 +135,18 @@ to exclude the API function. */
 #define INCLUDE_xTaskResumeFromISR              1
 #define INCLUDE_xQueueGetMutexHolder            1
 
+/* Run time stats count microseconds on the RP2040 timer, it is already running */
+#ifndef __ASSEMBLER__
+#include "hardware/timer.h"
+#endif
+#define portCONFIGURE_TIMER_FOR_RUN_TIME_STATS()
+#define portGET_RUN_TIME_COUNTER_VALUE()        time_us_32()
+
 /* A header file that defines trace macro can be included here. */
+#ifndef __ASSEMBLER__
+#include "trace.h"
+#endif
+#define traceTASK_SWITCHED_IN()                 trace_task_switched_in()
 
 /* SMP Related config. */
 #define configUSE_PASSIVE_IDLE_HOOK             0
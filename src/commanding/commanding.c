@@ -1,73 +1,189 @@
+#include <math.h>
+#include <stddef.h>
+
 #include "FreeRTOS.h"
 
 #include "pico/cyw43_arch.h"
 #include "pico/stdlib.h"
 
-#include "cJSON.h"
-
 #include "commanding.h"
 #include "config.h"
 #include "dance_generator.h"
+#include "dedupe.h"
+#include "groups.h"
+#include "json_parser.h"
+#include "log.h"
 #include "magnetometer.h"
+#include "motor.h"
+#include "motor_binary.h"
 #include "mqtt.h"
 #include "queue.h"
 #include "stdint.h"
 
 static uint32_t bad_json_count = 0;
+static uint32_t bad_binary_count = 0;
 uint32_t motor_queue_error = 0;  // Todo: Figure out how to make this not global
 
 uint32_t get_bad_json_count() { return bad_json_count; }
 
+uint32_t get_bad_binary_count() { return bad_binary_count; }
+
 uint32_t get_motor_queue_error_count() { return motor_queue_error; }
 
-static bool json_get_int(const cJSON *json, const char *name, int *ret_val) {
-  cJSON *num = cJSON_GetObjectItemCaseSensitive(json, name);
-  if (cJSON_IsNumber(num)) {
-    *ret_val = num->valueint;
-    return 0;
+// Command schemas, field order gives the bit in the parser's found mask
+struct LaunchJson {
+  double launch_time;
+  double heading;
+  int src;
+  double seq;
+};
+
+enum LaunchField { LAUNCH_TIME, LAUNCH_HEADING, LAUNCH_SRC, LAUNCH_SEQ, NUM_LAUNCH_FIELDS };
+
+static const struct JsonField LAUNCH_SCHEMA[NUM_LAUNCH_FIELDS] = {
+    [LAUNCH_TIME] = {"launch_time", JSON_DOUBLE, offsetof(struct LaunchJson, launch_time)},
+    [LAUNCH_HEADING] = {"heading", JSON_DOUBLE, offsetof(struct LaunchJson, heading)},
+    [LAUNCH_SRC] = {"src", JSON_INT, offsetof(struct LaunchJson, src)},
+    [LAUNCH_SEQ] = {"seq", JSON_DOUBLE, offsetof(struct LaunchJson, seq)},
+};
+
+struct MotorJson {
+  int type;
+  double duty_right;
+  double duty_left;
+  double Kp;
+  double Kd;
+  double heading;
+  int dur_ms;
+  int src;
+  double seq;
+};
+
+enum MotorField {
+  MOTOR_TYPE,
+  MOTOR_DUTY_RIGHT,
+  MOTOR_DUTY_LEFT,
+  MOTOR_KP,
+  MOTOR_KD,
+  MOTOR_HEADING,
+  MOTOR_DUR_MS,
+  MOTOR_SRC,
+  MOTOR_SEQ,
+  NUM_MOTOR_FIELDS
+};
+
+static const struct JsonField MOTOR_SCHEMA[NUM_MOTOR_FIELDS] = {
+    [MOTOR_TYPE] = {"type", JSON_INT, offsetof(struct MotorJson, type)},
+    [MOTOR_DUTY_RIGHT] = {"duty_right", JSON_DOUBLE, offsetof(struct MotorJson, duty_right)},
+    [MOTOR_DUTY_LEFT] = {"duty_left", JSON_DOUBLE, offsetof(struct MotorJson, duty_left)},
+    [MOTOR_KP] = {"Kp", JSON_DOUBLE, offsetof(struct MotorJson, Kp)},
+    [MOTOR_KD] = {"Kd", JSON_DOUBLE, offsetof(struct MotorJson, Kd)},
+    [MOTOR_HEADING] = {"heading", JSON_DOUBLE, offsetof(struct MotorJson, heading)},
+    [MOTOR_DUR_MS] = {"dur_ms", JSON_INT, offsetof(struct MotorJson, dur_ms)},
+    [MOTOR_SRC] = {"src", JSON_INT, offsetof(struct MotorJson, src)},
+    [MOTOR_SEQ] = {"seq", JSON_DOUBLE, offsetof(struct MotorJson, seq)},
+};
+
+struct WindJson {
+  double ww_dir;
+  int dur_s;
+  int inter_s;
+  int en;
+};
+
+enum WindField { WIND_DIR, WIND_DUR_S, WIND_INTER_S, WIND_EN, NUM_WIND_FIELDS };
+
+static const struct JsonField WIND_SCHEMA[NUM_WIND_FIELDS] = {
+    [WIND_DIR] = {"ww_dir", JSON_DOUBLE, offsetof(struct WindJson, ww_dir)},
+    [WIND_DUR_S] = {"dur_s", JSON_INT, offsetof(struct WindJson, dur_s)},
+    [WIND_INTER_S] = {"inter_s", JSON_INT, offsetof(struct WindJson, inter_s)},
+    [WIND_EN] = {"en", JSON_INT, offsetof(struct WindJson, en)},
+};
+
+struct GroupsJson {
+  double mask;
+};
+
+enum GroupsField { GROUPS_MASK, NUM_GROUPS_FIELDS };
+
+static const struct JsonField GROUPS_SCHEMA[NUM_GROUPS_FIELDS] = {
+    [GROUPS_MASK] = {"mask", JSON_DOUBLE, offsetof(struct GroupsJson, mask)},
+};
+
+static void send_command_ack(struct MqttParameters *mp, enum CommandAckType type,
+                             enum CommandAckStatus status, const struct MotorCommand *mc,
+                             size_t count) {
+  struct CommandAck ack = {type, status, 0, (uint16_t)count, 0};
+  if (mc) {
+    ack.src = mc->src;
+    ack.seq = mc->seq;
+  }
+  if (xQueueSendToBack(mp->ack_queue, &ack, 0) != pdTRUE) {
+    log_event(LOG_ACK_QUEUE_FULL, 0, 0, 0);
   }
-  return 1;
 }
 
-static bool json_get_double(const cJSON *json, const char *name, double *ret_val) {
-  cJSON *num = cJSON_GetObjectItemCaseSensitive(json, name);
-  if (cJSON_IsNumber(num)) {
-    *ret_val = num->valuedouble;
-    return 0;
+// Motor and launch commands are only acked when sequenced
+static void reject_command(struct MqttParameters *mp, enum CommandAckType type,
+                           const struct MotorCommand *mc) {
+  bad_json_count++;
+  if (mc->seq) {
+    send_command_ack(mp, type, ACK_REJECTED, mc, 0);
   }
-  return 1;
 }
 
-static void print_json(const char *data, const cJSON *json) {
-  if (JSON_DEBUG) {
-    // Print raw message
-    printf("Raw Message: %s.\n", data);
-
-    // Print JSON
-    char *string = cJSON_Print(json);
-    if (string == NULL) {
-      printf("Failed to print json.\n");
-    } else {
-      printf("JSON:\n%s\n", string);
-    }
+// Acks a redelivered command instead of executing it again, and rejects one too old to tell
+// Both are counted by dedupe.c
+// This function has early exits
+static bool is_new_sequenced_command(struct MqttParameters *mp, enum CommandAckType type,
+                                     const struct MotorCommand *mc) {
+  enum DedupeResult result = check_command(mc->src, mc->seq);
+  if (result == DEDUPE_NEW) {
+    return true;  // Early Exit!
   }
+  send_command_ack(mp, type, (result == DEDUPE_STALE) ? ACK_STALE : ACK_DUPLICATE, mc, 0);
+  return false;
 }
 
-static void free_bad_json(cJSON *json) {
-  bad_json_count++;
-  cJSON_Delete(json);
+// Optional JSON sender and sequence number, false if present but out of range
+// This function has early exits
+static bool read_sequence_fields(bool has_src, int src, bool has_seq, double seq,
+                                 struct MotorCommand *mc) {
+  if (!has_seq) {
+    return true;  // Early Exit!
+  }
+  if (!has_src) {
+    src = 0;
+  }
+  if ((src < 0) || (src >= MAX_COMMAND_SENDERS) || (seq < 0.0) || (seq > (double)UINT32_MAX) ||
+      (seq != floor(seq))) {
+    printf("Error reading sequence number\n");
+    return false;  // Early Exit!
+  }
+  mc->src = (uint8_t)src;
+  mc->seq = (uint32_t)seq;
+  return true;
 }
 
-static void set_duck_mode(struct MqttParameters *mp, enum DuckMode dm) {
+static void set_duck_mode(struct MqttParameters *mp, enum DuckMode dm, uint32_t received_us) {
   xQueueOverwrite(mp->duck_mode_mailbox, &dm);
-  xQueueReset(mp->motor_queue);
-  if (xSemaphoreGive(mp->motor_stop) == pdFALSE) {
-    printf("Error: Semaphore give motor stop\n");
+  stop_dance_sequencer();
+  xQueueReset(mp->override_queue);
+  xQueueReset(mp->corrective_mailbox);
+  request_motor_stop(mp->motor_stop, received_us);
+}
+
+static void enqueue_override(struct MqttParameters *mp, struct MotorCommand *mc,
+                             uint32_t received_us) {
+  mc->received_us = received_us;
+  if (xQueueSendToBack(mp->override_queue, mc, 0) != pdTRUE) {
+    motor_queue_error++;
   }
+  wake_motor_task();
 }
 
-void enqueue_calibrate_command(struct MqttParameters *mp) {
-  set_duck_mode(mp, CALIBRATE);
+void enqueue_calibrate_command(struct MqttParameters *mp, uint32_t received_us) {
+  set_duck_mode(mp, CALIBRATE, received_us);
 
   struct MotorCommand mc = {0};
 
@@ -75,9 +191,7 @@ void enqueue_calibrate_command(struct MqttParameters *mp) {
   mc.motor_left_duty_cycle = MID_DUTY_CYCLE;
   mc.remaining_time_ms = KASA_CALIBRATION_TIME_MS;
 
-  if (xQueueSendToBack(mp->motor_queue, &mc, 0) != pdTRUE) {
-    motor_queue_error++;
-  }
+  enqueue_override(mp, &mc, received_us);
 
   if (xSemaphoreGive(mp->calibrate) == pdFALSE) {
     printf("Error: Semaphore give calibrate\n");
@@ -85,193 +199,301 @@ void enqueue_calibrate_command(struct MqttParameters *mp) {
 }
 
 // This function has early exits
-void enqueue_launch_command(struct MqttParameters *mp, const char *data, uint16_t len) {
-  cJSON *json = cJSON_ParseWithLength(data, len);
+void enqueue_launch_command(struct MqttParameters *mp, const char *data, uint16_t len,
+                            uint32_t received_us) {
+  struct LaunchJson launch;
+  uint32_t found;
+  struct MotorCommand mc = {0};
 
-  if (json == NULL) {
+  json_debug_print(data, len);
+
+  if (!json_parse_fields(data, len, LAUNCH_SCHEMA, NUM_LAUNCH_FIELDS, &launch, &found)) {
     bad_json_count++;
     return;  // Early Exit!
   }
 
-  print_json(data, json);
-
-  double launch_time_s;
-  double launch_heading;
+  if (!read_sequence_fields(json_has_field(found, LAUNCH_SRC), launch.src,
+                            json_has_field(found, LAUNCH_SEQ), launch.seq, &mc)) {
+    bad_json_count++;
+    return;  // Early Exit!
+  }
 
-  if (json_get_double(json, "launch_time", &launch_time_s)) {
+  if (!json_has_field(found, LAUNCH_TIME)) {
     printf("Error reading launch time\n");
-    free_bad_json(json);
+    reject_command(mp, LAUNCH_ACK, &mc);
     return;  // Early Exit!
   }
 
-  if (json_get_double(json, "heading", &launch_heading)) {
+  if (!json_has_field(found, LAUNCH_HEADING)) {
     printf("Error reading launch heading\n");
-    free_bad_json(json);
+    reject_command(mp, LAUNCH_ACK, &mc);
     return;  // Early Exit!
   }
 
-  cJSON_Delete(json);
-
-  set_duck_mode(mp, LAUNCH);
+  if (!is_new_sequenced_command(mp, LAUNCH_ACK, &mc)) {
+    return;  // Early Exit!
+  }
 
-  struct MotorCommand mc = {0};
+  set_duck_mode(mp, LAUNCH, received_us);
 
   if (is_calibrated()) {
     mc.type = SWIM;
     mc.Kp = Kp;
     mc.Kd = Kd;
-    mc.desired_heading = launch_heading;
+    mc.desired_heading = launch.heading;
   } else {
     mc.type = MOTOR;
     mc.motor_left_duty_cycle = MID_DUTY_CYCLE;
     mc.motor_right_duty_cycle = MID_DUTY_CYCLE;
   }
 
-  mc.remaining_time_ms = (uint32_t)launch_time_s * 1000;
+  mc.remaining_time_ms = (uint32_t)launch.launch_time * 1000;
 
-  if (xQueueSendToBack(mp->motor_queue, &mc, 0) != pdTRUE) {
-    motor_queue_error++;
+  enqueue_override(mp, &mc, received_us);
+
+  if (mc.seq) {
+    send_command_ack(mp, LAUNCH_ACK, ACK_ACCEPTED, &mc, 1);
   }
 }
 
-void set_dance_mode(struct MqttParameters *mp) { set_duck_mode(mp, DANCE); }
+void set_dance_mode(struct MqttParameters *mp, uint32_t received_us) {
+  set_duck_mode(mp, DANCE, received_us);
+}
 
 // This function has early exits
-void enqueue_motor_command(struct MqttParameters *mp, const char *data, uint16_t len) {
-  cJSON *json = cJSON_ParseWithLength(data, len);
+void enqueue_motor_command(struct MqttParameters *mp, const char *data, uint16_t len,
+                           uint32_t received_us) {
+  struct MotorJson motor;
+  uint32_t found;
+
+  json_debug_print(data, len);
 
-  if (json == NULL) {
+  if (!json_parse_fields(data, len, MOTOR_SCHEMA, NUM_MOTOR_FIELDS, &motor, &found)) {
     bad_json_count++;
     return;  // Early Exit!
   }
 
-  print_json(data, json);
-
-  int num;
-  double num_f;
   struct MotorCommand mc = {0};
 
-  if (json_get_int(json, "type", &num)) {
+  if (!read_sequence_fields(json_has_field(found, MOTOR_SRC), motor.src,
+                            json_has_field(found, MOTOR_SEQ), motor.seq, &mc)) {
+    bad_json_count++;
+    return;  // Early Exit!
+  }
+
+  if (!json_has_field(found, MOTOR_TYPE)) {
     printf("Error reading type\n");
-    free_bad_json(json);
+    reject_command(mp, MOTOR_ACK, &mc);
     return;  // Early Exit!
   } else {
-    mc.type = (enum MotorCommandType)num;
+    mc.type = (enum MotorCommandType)motor.type;
   }
 
   switch (mc.type) {
     case MOTOR:
-      if (json_get_double(json, "duty_right", &num_f)) {
+      if (!json_has_field(found, MOTOR_DUTY_RIGHT)) {
         printf("Error reading right motor duty cycle\n");
-        free_bad_json(json);
+        reject_command(mp, MOTOR_ACK, &mc);
         return;  // Early Exit!
       } else {
-        mc.motor_right_duty_cycle = num_f;
+        mc.motor_right_duty_cycle = motor.duty_right;
       }
 
-      if (json_get_double(json, "duty_left", &num_f)) {
+      if (!json_has_field(found, MOTOR_DUTY_LEFT)) {
         printf("Error reading left motor duty cycle\n");
-        free_bad_json(json);
+        reject_command(mp, MOTOR_ACK, &mc);
         return;  // Early Exit!
       } else {
-        mc.motor_left_duty_cycle = num_f;
+        mc.motor_left_duty_cycle = motor.duty_left;
       }
       break;
     case SWIM:
-      if (json_get_double(json, "Kp", &num_f)) {
+      if (!json_has_field(found, MOTOR_KP)) {
         printf("Error reading Kp\n");
-        free_bad_json(json);
+        reject_command(mp, MOTOR_ACK, &mc);
         return;  // Early Exit!
       } else {
-        mc.Kp = num_f;
+        mc.Kp = motor.Kp;
       }
 
-      if (json_get_double(json, "Kd", &num_f)) {
+      if (!json_has_field(found, MOTOR_KD)) {
         printf("Error reading Kd\n");
-        free_bad_json(json);
+        reject_command(mp, MOTOR_ACK, &mc);
         return;  // Early Exit!
       } else {
-        mc.Kd = num_f;
+        mc.Kd = motor.Kd;
       }
       // Fall through!
     case POINT:
-      if (json_get_double(json, "heading", &num_f)) {
+      if (!json_has_field(found, MOTOR_HEADING)) {
         printf("Error reading heading\n");
-        free_bad_json(json);
+        reject_command(mp, MOTOR_ACK, &mc);
         return;  // Early Exit!
       } else {
-        mc.desired_heading = num_f;
+        mc.desired_heading = motor.heading;
       }
       break;
     case FLOAT:
       // All zeroes
       break;
     default:
-      free_bad_json(json);
+      reject_command(mp, MOTOR_ACK, &mc);
       return;  // Early Exit!
   }
 
-  if (json_get_int(json, "dur_ms", &num)) {
+  if (!json_has_field(found, MOTOR_DUR_MS)) {
     printf("Error reading duration in milliseconds\n");
-    free_bad_json(json);
+    reject_command(mp, MOTOR_ACK, &mc);
     return;  // Early Exit!
   } else {
-    mc.remaining_time_ms = num;
+    mc.remaining_time_ms = motor.dur_ms;
+  }
+
+  if (!is_new_sequenced_command(mp, MOTOR_ACK, &mc)) {
+    return;  // Early Exit!
   }
 
-  set_duck_mode(mp, OVERRIDE);
+  set_duck_mode(mp, OVERRIDE, received_us);
 
-  if (xQueueSendToBack(mp->motor_queue, &mc, 0) != pdTRUE) {
-    motor_queue_error++;
+  enqueue_override(mp, &mc, received_us);
+
+  if (mc.seq) {
+    send_command_ack(mp, MOTOR_ACK, ACK_ACCEPTED, &mc, 1);
   }
+}
 
-  cJSON_Delete(json);
+// This function has early exits
+void enqueue_motor_command_binary(struct MqttParameters *mp, const uint8_t *data, uint16_t len,
+                                  uint32_t received_us) {
+  struct MotorCommand mc;
+  if (!decode_motor_command_binary(data, len, &mc)) {
+    bad_binary_count++;
+    if (mc.seq) {
+      send_command_ack(mp, MOTOR_ACK, ACK_REJECTED, &mc, 0);
+    }
+    return;  // Early Exit!
+  }
+
+  if (!is_new_sequenced_command(mp, MOTOR_ACK, &mc)) {
+    return;  // Early Exit!
+  }
+
+  set_duck_mode(mp, OVERRIDE, received_us);
+
+  enqueue_override(mp, &mc, received_us);
+
+  if (mc.seq) {
+    send_command_ack(mp, MOTOR_ACK, ACK_ACCEPTED, &mc, 1);
+  }
 }
 
-void set_stop_mode(struct MqttParameters *mp) { set_duck_mode(mp, STOP); }
+// This function has early exits
+void enqueue_motor_sequence(struct MqttParameters *mp, const uint8_t *data, uint16_t len,
+                            uint32_t received_us) {
+  static struct MotorCommand sequence[MOTOR_QUEUE_DEPTH];
+  struct MotorCommand id;
+  size_t header_size;
+  size_t count;
+
+  if (!decode_sequence_header(data, len, &id, &header_size)) {
+    bad_binary_count++;
+    send_command_ack(mp, SEQUENCE_ACK, ACK_REJECTED, NULL, 0);
+    return;  // Early Exit!
+  }
+
+  if (!decode_motor_sequence(data, len, header_size, sequence, &count)) {
+    bad_binary_count++;
+    send_command_ack(mp, SEQUENCE_ACK, ACK_REJECTED, &id, 0);
+    return;  // Early Exit!
+  }
 
-void set_wind_config(struct MqttParameters *mp, const char *data, uint16_t len) {
-  cJSON *json = cJSON_ParseWithLength(data, len);
+  if (!is_new_sequenced_command(mp, SEQUENCE_ACK, &id)) {
+    return;  // Early Exit!
+  }
+
+  // Every move carries the sequence's id, including FLOAT gaps, the motor task reports it once
+  for (size_t i = 0; i < count; i++) {
+    sequence[i].src = id.src;
+    sequence[i].seq = id.seq;
+  }
+
+  // Resets the override queue, and the command task is its only producer, so every move fits
+  set_duck_mode(mp, OVERRIDE, received_us);
+
+  for (size_t i = 0; i < count; i++) {
+    enqueue_override(mp, &sequence[i], received_us);
+  }
 
-  if (json == NULL) {
+  send_command_ack(mp, SEQUENCE_ACK, ACK_ACCEPTED, &id, count);
+}
+
+void set_stop_mode(struct MqttParameters *mp, uint32_t received_us) {
+  set_duck_mode(mp, STOP, received_us);
+}
+
+// This function has early exits
+void set_group_membership(struct MqttParameters *mp, const char *data, uint16_t len) {
+  struct GroupsJson groups;
+  uint32_t found;
+
+  json_debug_print(data, len);
+
+  bool valid = json_parse_fields(data, len, GROUPS_SCHEMA, NUM_GROUPS_FIELDS, &groups, &found) &&
+               json_has_field(found, GROUPS_MASK) && (groups.mask >= 0.0) &&
+               (groups.mask <= (double)UINT32_MAX) && (groups.mask == floor(groups.mask));
+  if (!valid) {
+    printf("Error reading group mask\n");
     bad_json_count++;
+    send_command_ack(mp, GROUPS_ACK, ACK_REJECTED, NULL, 0);
     return;  // Early Exit!
   }
 
-  print_json(data, json);
+  uint32_t old_mask = get_group_mask();
+  uint32_t new_mask = (uint32_t)groups.mask;
+  bool saved = set_group_mask(new_mask);
+  update_group_subscriptions(old_mask, new_mask);
+
+  send_command_ack(mp, GROUPS_ACK, saved ? ACK_ACCEPTED : ACK_REJECTED, NULL,
+                   (size_t)__builtin_popcount(new_mask));
+}
+
+// This function has early exits
+void set_wind_config(struct MqttParameters *mp, const char *data, uint16_t len) {
+  struct WindJson wind;
+  uint32_t found;
+
+  json_debug_print(data, len);
 
-  double windward_dir;
-  int duration_s;
-  int interval_s;
-  int enable;
+  if (!json_parse_fields(data, len, WIND_SCHEMA, NUM_WIND_FIELDS, &wind, &found)) {
+    bad_json_count++;
+    return;  // Early Exit!
+  }
 
-  if (json_get_double(json, "ww_dir", &windward_dir)) {
+  if (!json_has_field(found, WIND_DIR)) {
     printf("Error windward direction\n");
-    free_bad_json(json);
+    bad_json_count++;
     return;  // Early Exit!
   }
 
-  if (json_get_int(json, "dur_s", &duration_s)) {
+  if (!json_has_field(found, WIND_DUR_S)) {
     printf("Error reading duration\n");
-    free_bad_json(json);
+    bad_json_count++;
     return;  // Early Exit!
   }
 
-  if (json_get_int(json, "inter_s", &interval_s)) {
+  if (!json_has_field(found, WIND_INTER_S)) {
     printf("Error reading interval\n");
-    free_bad_json(json);
+    bad_json_count++;
     return;  // Early Exit!
   }
 
-  if (json_get_int(json, "en", &enable)) {
+  if (!json_has_field(found, WIND_EN)) {
     printf("Error reading enable\n");
-    free_bad_json(json);
+    bad_json_count++;
     return;  // Early Exit!
   }
 
-  cJSON_Delete(json);
-
-  struct WindCorrection wc = {windward_dir, duration_s, interval_s, (bool)enable};
+  struct WindCorrection wc = {wind.ww_dir, wind.dur_s, wind.inter_s, (bool)wind.en};
 
   xQueueOverwrite(mp->wind_mailbox, &wc);
-}
\ No newline at end of file
+}
@@ -15,7 +15,7 @@ enum MotorCommandType {
 };
 
 struct MotorCommand {
-  uint16_t version;
+  uint16_t version;  // Binary wire version, 0 when sent as JSON
   enum MotorCommandType type;
   double motor_right_duty_cycle;
   double motor_left_duty_cycle;
@@ -24,16 +24,57 @@ struct MotorCommand {
   double Kd;
   double previous_error;
   uint32_t remaining_time_ms;
+  uint32_t received_us;  // Command receipt time, for lane latency
+  uint8_t src;           // Sender and sequence number, seq is 0 when not sequenced
+  uint32_t seq;
+};
+
+enum CommandAckType {
+  SEQUENCE_ACK = 0,
+  GROUPS_ACK = 1,
+  MOTOR_ACK = 2,
+  LAUNCH_ACK = 3,
+  EXECUTED_EVENT = 4,  // Sent by the motor task when a sequenced command starts
+};
+
+enum CommandAckStatus {
+  ACK_REJECTED = 0,
+  ACK_ACCEPTED = 1,
+  ACK_DUPLICATE = 2,  // Already seen, not executed again
+  ACK_STALE = 3,      // Too old to tell whether it ran, not executed
+};
+
+// Result of a command, queued to the publish task and sent on the ack or event topic
+struct CommandAck {
+  enum CommandAckType type;
+  enum CommandAckStatus status;
+  uint8_t src;
+  uint16_t count;  // Moves enqueued, or groups joined
+  uint32_t seq;
 };
 
 uint32_t get_bad_json_count();
+uint32_t get_bad_binary_count();  // Malformed binary motor commands and sequences
 uint32_t get_motor_queue_error_count();
 
-void enqueue_calibrate_command(struct MqttParameters *mp);
-void enqueue_launch_command(struct MqttParameters *mp, const char *data, uint16_t len);
-void set_dance_mode(struct MqttParameters *mp);
-void enqueue_motor_command(struct MqttParameters *mp, const char *data, uint16_t len);
-void set_stop_mode(struct MqttParameters *mp);
+// received_us is the time_us_32() timestamp of when the command arrived
+// Motor, launch and sequence commands take an optional sender and sequence number, and
+// sequenced commands are acked once and executed at most once
+void enqueue_calibrate_command(struct MqttParameters *mp, uint32_t received_us);
+void enqueue_launch_command(struct MqttParameters *mp, const char *data, uint16_t len,
+                            uint32_t received_us);
+void set_dance_mode(struct MqttParameters *mp, uint32_t received_us);
+void enqueue_motor_command(struct MqttParameters *mp, const char *data, uint16_t len,
+                           uint32_t received_us);
+// Fixed layout motor command, see motor_binary.c for the wire format
+void enqueue_motor_command_binary(struct MqttParameters *mp, const uint8_t *data, uint16_t len,
+                                  uint32_t received_us);
+// Up to MOTOR_QUEUE_DEPTH binary moves, enqueued together or not at all, see motor_binary.c
+void enqueue_motor_sequence(struct MqttParameters *mp, const uint8_t *data, uint16_t len,
+                            uint32_t received_us);
+void set_stop_mode(struct MqttParameters *mp, uint32_t received_us);
+// {"mask": <uint32>}, bit g joins group g, saved across reboots
+void set_group_membership(struct MqttParameters *mp, const char *data, uint16_t len);
 void set_wind_config(struct MqttParameters *mp, const char *data, uint16_t len);
 
 #endif
\ No newline at end of file
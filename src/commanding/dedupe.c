@@ -0,0 +1,57 @@
+#include "dedupe.h"
+#include "stdint.h"
+
+// Sequence numbers within this distance of the newest are tracked, older ones are stale
+static const uint32_t DEDUPE_WINDOW = 32;
+
+struct DedupeWindow {
+  bool valid;
+  uint32_t newest;
+  uint32_t seen;  // Bit n set when newest - n was seen
+};
+
+// Only touched by the command task
+static struct DedupeWindow windows[MAX_COMMAND_SENDERS];
+static uint32_t duplicate_count = 0;
+static uint32_t stale_count = 0;
+
+uint32_t get_duplicate_command_count() { return duplicate_count; }
+
+uint32_t get_stale_command_count() { return stale_count; }
+
+// This function has early exits
+enum DedupeResult check_command(uint8_t src, uint32_t seq) {
+  if ((seq == 0) || (src >= MAX_COMMAND_SENDERS)) {
+    return DEDUPE_NEW;  // Early Exit!
+  }
+
+  struct DedupeWindow *window = &windows[src];
+  if (!window->valid) {
+    window->valid = true;
+    window->newest = seq;
+    window->seen = 1;
+    return DEDUPE_NEW;  // Early Exit!
+  }
+
+  // Serial number arithmetic, so a wrapping sender keeps working
+  int32_t ahead = (int32_t)(seq - window->newest);
+  if (ahead > 0) {
+    window->seen = ((uint32_t)ahead >= DEDUPE_WINDOW) ? 1 : ((window->seen << ahead) | 1);
+    window->newest = seq;
+    return DEDUPE_NEW;  // Early Exit!
+  }
+
+  uint32_t age = (uint32_t)(-ahead);
+  if (age >= DEDUPE_WINDOW) {
+    stale_count++;
+    return DEDUPE_STALE;  // Early Exit!
+  }
+
+  if (window->seen & (1u << age)) {
+    duplicate_count++;
+    return DEDUPE_DUPLICATE;  // Early Exit!
+  }
+
+  window->seen |= (1u << age);
+  return DEDUPE_NEW;
+}
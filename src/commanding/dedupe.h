@@ -0,0 +1,23 @@
+#ifndef _DD_DEDUPE_H
+#define _DD_DEDUPE_H
+
+#include <stdbool.h>
+
+#include "stdint.h"
+
+// Senders number their commands, so a QoS 1 redelivery is not executed twice
+enum { MAX_COMMAND_SENDERS = 8 };
+
+enum DedupeResult {
+  DEDUPE_NEW,        // Not seen before, now marked seen
+  DEDUPE_DUPLICATE,  // Seen before, already executed
+  DEDUPE_STALE,      // Older than the window, unknown whether it was executed
+};
+
+// Sequence number 0 means unsequenced and is always new
+enum DedupeResult check_command(uint8_t src, uint32_t seq);
+
+uint32_t get_duplicate_command_count();
+uint32_t get_stale_command_count();
+
+#endif
@@ -0,0 +1,292 @@
+#include <limits.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+
+#include "config.h"
+#include "json_parser.h"
+#include "stdint.h"
+
+/*
+ * Streaming reader for the flat command objects sent over MQTT
+ *
+ * Keys are compared in place against the schema and numbers are converted as they are read,
+ * so there is no token array, node tree or heap use. Values of unknown keys, including nested
+ * objects and arrays, are skipped.
+ */
+
+enum {
+  MAX_SIGNIFICANT_DIGITS = 19,  // Fits a uint64_t mantissa
+  MAX_DECIMAL_EXPONENT = 308,
+};
+
+struct JsonCursor {
+  const char *data;
+  size_t len;
+  size_t pos;
+};
+
+static bool at_end(const struct JsonCursor *c) { return c->pos >= c->len; }
+
+static char peek(const struct JsonCursor *c) { return at_end(c) ? '\0' : c->data[c->pos]; }
+
+static bool is_digit(char ch) { return (ch >= '0') && (ch <= '9'); }
+
+static void skip_whitespace(struct JsonCursor *c) {
+  while (!at_end(c)) {
+    char ch = c->data[c->pos];
+    if ((ch != ' ') && (ch != '\t') && (ch != '\n') && (ch != '\r')) {
+      break;
+    }
+    c->pos++;
+  }
+}
+
+static bool expect(struct JsonCursor *c, char ch) {
+  if (peek(c) != ch) {
+    return false;
+  }
+  c->pos++;
+  return true;
+}
+
+// Cursor must be on the opening quote, leaves it after the closing quote
+static bool skip_string(struct JsonCursor *c) {
+  c->pos++;
+  while (!at_end(c)) {
+    char ch = c->data[c->pos++];
+    if (ch == '\\') {
+      c->pos++;
+    } else if (ch == '"') {
+      return true;
+    }
+  }
+  return false;
+}
+
+static double scale_decimal(double value, int32_t exponent) {
+  static const double POWERS_OF_TEN[] = {1e1, 1e2, 1e4, 1e8, 1e16, 1e32, 1e64, 1e128, 1e256};
+
+  bool negative = (exponent < 0);
+  uint32_t remaining = negative ? (uint32_t)-exponent : (uint32_t)exponent;
+  double scale = 1.0;
+  for (size_t i = 0; remaining && (i < sizeof(POWERS_OF_TEN) / sizeof(POWERS_OF_TEN[0])); i++) {
+    if (remaining & 1) {
+      scale *= POWERS_OF_TEN[i];
+    }
+    remaining >>= 1;
+  }
+  return negative ? value / scale : value * scale;
+}
+
+// This function has early exits
+static bool parse_number(struct JsonCursor *c, double *value) {
+  bool negative = expect(c, '-');
+  if (!is_digit(peek(c))) {
+    return false;  // Early Exit!
+  }
+
+  uint64_t mantissa = 0;
+  int digits = 0;
+  int32_t exponent = 0;
+
+  while (is_digit(peek(c))) {
+    if (digits < MAX_SIGNIFICANT_DIGITS) {
+      mantissa = mantissa * 10 + (uint64_t)(c->data[c->pos] - '0');
+      if (mantissa) {
+        digits++;
+      }
+    } else {
+      exponent++;
+    }
+    c->pos++;
+  }
+
+  if (expect(c, '.')) {
+    if (!is_digit(peek(c))) {
+      return false;  // Early Exit!
+    }
+    while (is_digit(peek(c))) {
+      if (digits < MAX_SIGNIFICANT_DIGITS) {
+        mantissa = mantissa * 10 + (uint64_t)(c->data[c->pos] - '0');
+        if (mantissa) {
+          digits++;
+        }
+        exponent--;
+      }
+      c->pos++;
+    }
+  }
+
+  if ((peek(c) == 'e') || (peek(c) == 'E')) {
+    c->pos++;
+    bool negative_exponent = false;
+    if (peek(c) == '+' || peek(c) == '-') {
+      negative_exponent = (c->data[c->pos] == '-');
+      c->pos++;
+    }
+    if (!is_digit(peek(c))) {
+      return false;  // Early Exit!
+    }
+    int32_t written = 0;
+    while (is_digit(peek(c))) {
+      if (written < MAX_DECIMAL_EXPONENT * 2) {
+        written = written * 10 + (c->data[c->pos] - '0');
+      }
+      c->pos++;
+    }
+    exponent += negative_exponent ? -written : written;
+  }
+
+  if (exponent > MAX_DECIMAL_EXPONENT) {
+    exponent = MAX_DECIMAL_EXPONENT;
+  } else if (exponent < -MAX_DECIMAL_EXPONENT) {
+    exponent = -MAX_DECIMAL_EXPONENT;
+  }
+
+  *value = scale_decimal((double)mantissa, exponent);
+  if (negative) {
+    *value = -*value;
+  }
+  return true;
+}
+
+// Skips a string, literal, number, or a whole nested object or array
+// This function has early exits
+static bool skip_value(struct JsonCursor *c) {
+  char ch = peek(c);
+
+  if (ch == '"') {
+    return skip_string(c);  // Early Exit!
+  }
+
+  if ((ch == '{') || (ch == '[')) {
+    size_t depth = 0;
+    while (!at_end(c)) {
+      ch = c->data[c->pos];
+      if (ch == '"') {
+        if (!skip_string(c)) {
+          return false;  // Early Exit!
+        }
+        continue;
+      }
+      c->pos++;
+      if ((ch == '{') || (ch == '[')) {
+        depth++;
+      } else if (((ch == '}') || (ch == ']')) && (--depth == 0)) {
+        return true;  // Early Exit!
+      }
+    }
+    return false;  // Early Exit!
+  }
+
+  // Numbers and true, false, null
+  size_t start = c->pos;
+  while (!at_end(c)) {
+    ch = c->data[c->pos];
+    if ((ch == ',') || (ch == '}') || (ch == ']') || (ch == ' ') || (ch == '\t') ||
+        (ch == '\n') || (ch == '\r')) {
+      break;
+    }
+    c->pos++;
+  }
+  return c->pos != start;
+}
+
+// Saturating conversion, same as cJSON valueint
+static int double_to_int(double value) {
+  if (value >= (double)INT_MAX) {
+    return INT_MAX;
+  }
+  if (value <= (double)INT_MIN) {
+    return INT_MIN;
+  }
+  return (int)value;
+}
+
+static void store_field(const struct JsonField *field, double value, void *result) {
+  uint8_t *dest = (uint8_t *)result + field->offset;
+  if (field->type == JSON_INT) {
+    int num = double_to_int(value);
+    memcpy(dest, &num, sizeof(num));
+  } else {
+    memcpy(dest, &value, sizeof(value));
+  }
+}
+
+static int find_field(const char *key, size_t key_len, const struct JsonField *fields,
+                      size_t field_count) {
+  for (size_t i = 0; i < field_count; i++) {
+    if ((strncmp(fields[i].name, key, key_len) == 0) && (fields[i].name[key_len] == '\0')) {
+      return (int)i;
+    }
+  }
+  return -1;
+}
+
+// This function has early exits
+bool json_parse_fields(const char *data, size_t len, const struct JsonField *fields,
+                       size_t field_count, void *result, uint32_t *found) {
+  struct JsonCursor c = {data, len, 0};
+  *found = 0;
+
+  skip_whitespace(&c);
+  if (!expect(&c, '{')) {
+    return false;  // Early Exit!
+  }
+
+  skip_whitespace(&c);
+  if (expect(&c, '}')) {
+    return true;  // Early Exit!
+  }
+
+  for (;;) {
+    skip_whitespace(&c);
+    if (peek(&c) != '"') {
+      return false;  // Early Exit!
+    }
+
+    const char *key = &c.data[c.pos + 1];
+    if (!skip_string(&c)) {
+      return false;  // Early Exit!
+    }
+    size_t key_len = (size_t)(&c.data[c.pos - 1] - key);
+
+    skip_whitespace(&c);
+    if (!expect(&c, ':')) {
+      return false;  // Early Exit!
+    }
+    skip_whitespace(&c);
+
+    // Only the first occurrence of a key counts, as with cJSON
+    int index = find_field(key, key_len, fields, field_count);
+    char ch = peek(&c);
+    if ((index >= 0) && !(*found & (1u << index)) && ((ch == '-') || is_digit(ch))) {
+      double value;
+      if (!parse_number(&c, &value)) {
+        return false;  // Early Exit!
+      }
+      store_field(&fields[index], value, result);
+      *found |= (1u << index);
+    } else if (!skip_value(&c)) {
+      return false;  // Early Exit!
+    }
+
+    skip_whitespace(&c);
+    if (expect(&c, '}')) {
+      return true;  // Early Exit!
+    }
+    if (!expect(&c, ',')) {
+      return false;  // Early Exit!
+    }
+  }
+}
+
+bool json_has_field(uint32_t found, int field) { return found & (1u << field); }
+
+void json_debug_print(const char *data, size_t len) {
+  if (JSON_DEBUG) {
+    // Print raw message
+    printf("Raw Message: %.*s.\n", (int)len, data);
+  }
+}
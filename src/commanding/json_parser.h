@@ -0,0 +1,31 @@
+#ifndef _DD_JSON_PARSER_H
+#define _DD_JSON_PARSER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "stdint.h"
+
+enum JsonFieldType {
+  JSON_INT,
+  JSON_DOUBLE,
+};
+
+// One known key of a command, written at offset into the caller's result struct
+struct JsonField {
+  const char *name;
+  enum JsonFieldType type;
+  size_t offset;
+};
+
+// Single pass over a flat JSON object, no allocation and no copy of the payload
+// Bit i of found is set when fields[i] was present with a numeric value
+// Unknown keys are skipped, returns false if the payload is not a well formed object
+bool json_parse_fields(const char *data, size_t len, const struct JsonField *fields,
+                       size_t field_count, void *result, uint32_t *found);
+// True if fields[field] was in the payload
+bool json_has_field(uint32_t found, int field);
+// Prints the raw payload when JSON_DEBUG is set
+void json_debug_print(const char *data, size_t len);
+
+#endif
@@ -0,0 +1,191 @@
+#include <math.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+
+#include "commanding.h"
+#include "config.h"
+#include "dedupe.h"
+#include "motor_binary.h"
+#include "stdint.h"
+
+/*
+ * Binary motor command, little endian
+ *
+ * uint16_t version
+ * uint8_t type       enum MotorCommandType
+ * uint8_t src        Version 1: reserved, 0
+ * float duty_right
+ * float duty_left
+ * float heading
+ * float Kp
+ * float Kd
+ * uint32_t dur_ms
+ * uint32_t seq       Version 2 only
+ */
+enum {
+  MOTOR_COMMAND_BINARY_VERSION = 1,
+  MOTOR_COMMAND_SEQUENCED_VERSION = 2,
+  MOTOR_COMMAND_WIRE_SIZE = 28,
+  MOTOR_COMMAND_SEQUENCED_WIRE_SIZE = 32,
+};
+
+static uint32_t read_u32_le(const uint8_t *data) {
+  return (uint32_t)data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16) |
+         ((uint32_t)data[3] << 24);
+}
+
+static double read_float_le(const uint8_t *data) {
+  uint32_t bits = read_u32_le(data);
+  float value;
+  memcpy(&value, &bits, sizeof(value));
+  return (double)value;
+}
+
+// This function has early exits
+bool decode_motor_command_binary(const uint8_t *data, uint16_t len, struct MotorCommand *mc) {
+  memset(mc, 0, sizeof(struct MotorCommand));
+
+  if (len < MOTOR_COMMAND_WIRE_SIZE) {
+    printf("Error binary motor command length %u\n", (unsigned int)len);
+    return false;  // Early Exit!
+  }
+
+  mc->version = (uint16_t)(data[0] | (data[1] << 8));
+  bool valid_v1 = (mc->version == MOTOR_COMMAND_BINARY_VERSION) &&
+                  (len == MOTOR_COMMAND_WIRE_SIZE) && (data[3] == 0);
+  bool valid_v2 = (mc->version == MOTOR_COMMAND_SEQUENCED_VERSION) &&
+                  (len == MOTOR_COMMAND_SEQUENCED_WIRE_SIZE) && (data[3] < MAX_COMMAND_SENDERS);
+  if (!valid_v1 && !valid_v2) {
+    printf("Error binary motor command version %u\n", (unsigned int)mc->version);
+    return false;  // Early Exit!
+  }
+
+  if (valid_v2) {
+    mc->src = data[3];
+    mc->seq = read_u32_le(&data[28]);
+  }
+
+  double duty_right = read_float_le(&data[4]);
+  double duty_left = read_float_le(&data[8]);
+  double heading = read_float_le(&data[12]);
+  double command_Kp = read_float_le(&data[16]);
+  double command_Kd = read_float_le(&data[20]);
+  if (!isfinite(duty_right) || !isfinite(duty_left) || !isfinite(heading) ||
+      !isfinite(command_Kp) || !isfinite(command_Kd)) {
+    printf("Error binary motor command value\n");
+    return false;  // Early Exit!
+  }
+
+  mc->type = (enum MotorCommandType)data[2];
+  switch (mc->type) {
+    case MOTOR:
+      mc->motor_right_duty_cycle = duty_right;
+      mc->motor_left_duty_cycle = duty_left;
+      break;
+    case SWIM:
+      mc->Kp = command_Kp;
+      mc->Kd = command_Kd;
+      // Fall through!
+    case POINT:
+      mc->desired_heading = heading;
+      break;
+    case FLOAT:
+      // All zeroes
+      break;
+    default:
+      return false;  // Early Exit!
+  }
+
+  mc->remaining_time_ms = read_u32_le(&data[24]);
+  return true;
+}
+
+/*
+ * Motor sequence, little endian
+ *
+ * uint8_t version
+ * uint8_t move_count
+ * uint8_t src         Version 2 only
+ * uint32_t seq        Version 2 only
+ * For each move:
+ *   uint32_t start_ms   Offset from receipt, 0 to follow the previous move
+ *   binary motor command, version 1 (28 bytes)
+ *
+ * Gaps before a start time are filled with FLOAT, and count against MOTOR_QUEUE_DEPTH.
+ */
+enum {
+  MOTOR_SEQUENCE_VERSION = 1,
+  MOTOR_SEQUENCE_SEQUENCED_VERSION = 2,
+  SEQUENCE_HEADER_WIRE_SIZE = 2,
+  SEQUENCE_SEQUENCED_HEADER_WIRE_SIZE = 7,
+  SEQUENCE_MOVE_WIRE_SIZE = 4 + MOTOR_COMMAND_WIRE_SIZE,
+};
+
+// This function has early exits
+bool decode_sequence_header(const uint8_t *data, uint16_t len, struct MotorCommand *id,
+                            size_t *header_size) {
+  memset(id, 0, sizeof(struct MotorCommand));
+
+  if ((len >= SEQUENCE_HEADER_WIRE_SIZE) && (data[0] == MOTOR_SEQUENCE_VERSION)) {
+    *header_size = SEQUENCE_HEADER_WIRE_SIZE;
+    return true;  // Early Exit!
+  }
+
+  if ((len >= SEQUENCE_SEQUENCED_HEADER_WIRE_SIZE) &&
+      (data[0] == MOTOR_SEQUENCE_SEQUENCED_VERSION) && (data[2] < MAX_COMMAND_SENDERS)) {
+    id->src = data[2];
+    id->seq = read_u32_le(&data[3]);
+    *header_size = SEQUENCE_SEQUENCED_HEADER_WIRE_SIZE;
+    return true;  // Early Exit!
+  }
+
+  printf("Sequence: bad header\n");
+  return false;
+}
+
+// This function has early exits
+bool decode_motor_sequence(const uint8_t *data, uint16_t len, size_t header_size,
+                           struct MotorCommand *sequence, size_t *count) {
+  *count = 0;
+
+  size_t move_count = data[1];
+  if ((move_count == 0) || (len != header_size + move_count * SEQUENCE_MOVE_WIRE_SIZE)) {
+    printf("Sequence: bad length for %u moves\n", (unsigned int)move_count);
+    return false;  // Early Exit!
+  }
+
+  uint32_t end_ms = 0;
+  const uint8_t *move = &data[header_size];
+  for (size_t m = 0; m < move_count; m++, move += SEQUENCE_MOVE_WIRE_SIZE) {
+    uint32_t start_ms = read_u32_le(move);
+    if (start_ms && (start_ms < end_ms)) {
+      printf("Sequence: move %u starts before the previous one ends\n", (unsigned int)m);
+      return false;  // Early Exit!
+    }
+
+    bool gap = (start_ms > end_ms);
+    if (*count + (gap ? 2 : 1) > MOTOR_QUEUE_DEPTH) {
+      printf("Sequence: more than %u commands\n", (unsigned int)MOTOR_QUEUE_DEPTH);
+      return false;  // Early Exit!
+    }
+
+    if (gap) {
+      struct MotorCommand *mc = &sequence[(*count)++];
+      memset(mc, 0, sizeof(struct MotorCommand));
+      mc->type = FLOAT;
+      mc->remaining_time_ms = start_ms - end_ms;
+      end_ms = start_ms;
+    }
+
+    struct MotorCommand *mc = &sequence[(*count)++];
+    if (!decode_motor_command_binary(&move[4], MOTOR_COMMAND_WIRE_SIZE, mc)) {
+      printf("Sequence: bad move %u\n", (unsigned int)m);
+      return false;  // Early Exit!
+    }
+    end_ms += mc->remaining_time_ms;
+  }
+
+  return true;
+}
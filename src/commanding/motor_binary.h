@@ -0,0 +1,22 @@
+#ifndef _DD_MOTOR_BINARY_H
+#define _DD_MOTOR_BINARY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "commanding.h"
+#include "stdint.h"
+
+// Fixed layout motor command, see motor_binary.c for the wire format
+// A sequenced command keeps its src and seq when its contents are rejected, so it can be acked
+bool decode_motor_command_binary(const uint8_t *data, uint16_t len, struct MotorCommand *mc);
+
+// Motor sequence, the sender and sequence number go in id, the moves start at header_size
+bool decode_sequence_header(const uint8_t *data, uint16_t len, struct MotorCommand *id,
+                            size_t *header_size);
+// Expands the moves into sequence, with FLOAT gaps before later start times
+// False if malformed or longer than MOTOR_QUEUE_DEPTH commands
+bool decode_motor_sequence(const uint8_t *data, uint16_t len, size_t header_size,
+                           struct MotorCommand *sequence, size_t *count);
+
+#endif
@@ -9,6 +9,7 @@ static const uint32_t WATCHDOG_DELAY_MS = 250;
 static const uint32_t WATCHDOG_TIMEOUT_MS = 8000; /* Do not exceed 8333 */
 static const uint32_t DD_MAGIC_NUM = 0xDECAFDAD;
 static const bool DEBUG_IDLE = false;
+static const bool TRACE_ENABLED = true;  // Hot path trace recorder, dumped with command/trace_dump
 
 // Wifi
 enum WifiMode {
@@ -29,8 +30,10 @@ enum DuckMode {
 
 static const enum WifiMode WIFI_MODE = MQTT;
 static const uint32_t WIFI_TIMEOUT_MS = 7000; /* Ensure less than WATCHDOG_TIMEOUT_MS */
-static const int32_t WIFI_CONNECT_RETRY_COUNT = 5;
 static const bool PRINT_WIFI_CREDS = false;
+static const uint32_t CONNECT_BACKOFF_MIN_MS = 500;
+static const uint32_t CONNECT_BACKOFF_MAX_MS = 30000;
+static const uint32_t LINK_CHECK_INTERVAL_MS = 1000;
 
 // Blink Task
 static const uint32_t BLINK_DELAY_MS = 500;
@@ -40,7 +43,22 @@ static const bool BLINK_DEBUG = 0;
 static const bool JSON_DEBUG = 0;
 
 // FreeRTOS Resources
-static const uint32_t MOTOR_QUEUE_DEPTH = 16;
+enum { MOTOR_QUEUE_DEPTH = 16 };  // Also the longest command sequence
+static const uint32_t ACK_QUEUE_DEPTH = 8;
+static const size_t COMMAND_BUFFER_SIZE = 4096;  // Bytes, at least two full MQTT payloads
+
+// MQTT
+enum { MQTT_PAYLOAD_MAX_BYTES = 1536 };  // Largest reassembled publish, fits a full choreography
+static const uint32_t MQTT_CONNECT_TIMEOUT_MS = 5000;
+static const uint16_t MQTT_KEEP_ALIVE_S = 10;
+enum { TELEMETRY_FRAME_MAX_BYTES = 1400 };  // One TCP segment, keep below MQTT_OUTPUT_RINGBUF_SIZE
+static const bool TELEMETRY_BINARY = true;  // 1 Hz metrics as a packed record, else line protocol
+static const uint32_t SHED_RING_REDUCED_PCT = 25;  // MQTT output ring still in use a second later
+static const uint32_t SHED_RING_MINIMAL_PCT = 50;
+static const uint32_t SHED_PENDING_REDUCED = 4;  // Publishes waiting to be sent or acked
+static const uint32_t SHED_PENDING_MINIMAL = 16;
+static const int32_t SHED_RSSI_POOR_DBM = -80;
+static const uint32_t SHED_RECOVER_S = 10;  // Clear link time before stepping down a level
 
 // Magnetometer
 static const size_t KASA_ARRAY_DEPTH = 250;  // 25 Seconds
@@ -50,6 +68,10 @@ static const double KASA_RMSE_UPPER_LIMIT = 10.0;
 // Small value to check for near-zero conditions
 static const double EPSILON = 1e-10;
 static const uint32_t KASA_CALIBRATION_TIME_MS = 25000;
+static const uint32_t MAG_STREAM_DEPTH = 64;  // Samples, 6.4 seconds
+enum { MAG_STREAM_CHUNK_SAMPLES = 20 };       // 2 seconds per publish
+static const uint32_t MAG_STREAM_DEFAULT_S = 30;
+static const uint32_t MAG_STREAM_MAX_S = 120;
 
 // Motor
 static const double MIN_DUTY_CYCLE = 0.7;
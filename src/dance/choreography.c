@@ -0,0 +1,202 @@
+#include <inttypes.h>
+#include <string.h>
+
+#include "FreeRTOS.h"
+
+#include "pico/printf.h"
+
+#include "choreography.h"
+#include "commanding.h"
+#include "config.h"
+#include "stdint.h"
+#include "task.h"
+
+/*
+ * Choreography wire format, version 1, little endian
+ *
+ * uint8_t format_version
+ * uint8_t routine_count
+ * For each routine:
+ *   uint8_t move_count
+ *   struct DanceMove moves[move_count]
+ */
+
+enum {
+  CHOREOGRAPHY_FORMAT_VERSION = 1,
+  CHOREOGRAPHY_MAX_ROUTINES = 16,
+  CHOREOGRAPHY_MAX_MOVES = 128,
+  DANCE_MOVE_WIRE_SIZE = 10,
+};
+
+static const int16_t MAX_DUTY_PM = 1000;
+static const int16_t MAX_HEADING_DDEG = 3600;
+
+struct ChoreographyPool {
+  uint32_t hash;
+  size_t routine_count;
+  uint8_t routine_start[CHOREOGRAPHY_MAX_ROUTINES];
+  uint8_t routine_size[CHOREOGRAPHY_MAX_ROUTINES];
+  struct DanceMove moves[CHOREOGRAPHY_MAX_MOVES];
+};
+
+// Staging is only touched by the command task, active is shared with the motor task
+static struct ChoreographyPool staging_pool;
+static struct ChoreographyPool active_pool;
+static uint32_t reject_count = 0;
+
+static uint32_t fnv1a_hash(const uint8_t *data, size_t len) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= data[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static uint16_t read_u16_le(const uint8_t *data) {
+  return (uint16_t)(data[0] | ((uint16_t)data[1] << 8));
+}
+
+static bool decode_dance_move(const uint8_t *data, struct DanceMove *move) {
+  move->type = data[0];
+  move->flags = data[1];
+  move->duration_ds = read_u16_le(&data[2]);
+  move->right_duty_pm = (int16_t)read_u16_le(&data[4]);
+  move->left_duty_pm = (int16_t)read_u16_le(&data[6]);
+  move->heading_ddeg = (int16_t)read_u16_le(&data[8]);
+
+  if ((move->type > FLOAT) || (move->flags & ~MOVE_FLAG_RANDOM_HEADING) ||
+      (move->duration_ds == 0)) {
+    return false;
+  }
+  if ((move->right_duty_pm > MAX_DUTY_PM) || (move->right_duty_pm < -MAX_DUTY_PM) ||
+      (move->left_duty_pm > MAX_DUTY_PM) || (move->left_duty_pm < -MAX_DUTY_PM)) {
+    return false;
+  }
+  if ((move->heading_ddeg < 0) || (move->heading_ddeg > MAX_HEADING_DDEG)) {
+    return false;
+  }
+  return true;
+}
+
+// This function has early exits
+static bool parse_choreography(const uint8_t *data, size_t len, struct ChoreographyPool *pool) {
+  memset(pool, 0, sizeof(struct ChoreographyPool));
+
+  if ((len < 2) || (data[0] != CHOREOGRAPHY_FORMAT_VERSION)) {
+    printf("Choreography: bad header\n");
+    return false;  // Early Exit!
+  }
+
+  pool->routine_count = data[1];
+  if ((pool->routine_count == 0) || (pool->routine_count > CHOREOGRAPHY_MAX_ROUTINES)) {
+    printf("Choreography: bad routine count %u\n", (unsigned int)pool->routine_count);
+    return false;  // Early Exit!
+  }
+
+  size_t offset = 2;
+  size_t move_total = 0;
+  for (size_t r = 0; r < pool->routine_count; r++) {
+    if (offset >= len) {
+      printf("Choreography: truncated at routine %u\n", (unsigned int)r);
+      return false;  // Early Exit!
+    }
+
+    size_t move_count = data[offset++];
+    if ((move_count == 0) || (move_total + move_count > CHOREOGRAPHY_MAX_MOVES) ||
+        (offset + move_count * DANCE_MOVE_WIRE_SIZE > len)) {
+      printf("Choreography: bad move count in routine %u\n", (unsigned int)r);
+      return false;  // Early Exit!
+    }
+
+    pool->routine_start[r] = (uint8_t)move_total;
+    pool->routine_size[r] = (uint8_t)move_count;
+    for (size_t m = 0; m < move_count; m++) {
+      if (!decode_dance_move(&data[offset], &pool->moves[move_total])) {
+        printf("Choreography: bad move %u in routine %u\n", (unsigned int)m, (unsigned int)r);
+        return false;  // Early Exit!
+      }
+      offset += DANCE_MOVE_WIRE_SIZE;
+      move_total++;
+    }
+  }
+
+  if (offset != len) {
+    printf("Choreography: %u trailing bytes\n", (unsigned int)(len - offset));
+    return false;  // Early Exit!
+  }
+
+  // A hash of 0 is reserved for the built-in routines
+  pool->hash = fnv1a_hash(data, len);
+  if (pool->hash == 0) {
+    pool->hash = 1;
+  }
+  return true;
+}
+
+void choreography_load(const uint8_t *data, size_t len) {
+  if (!parse_choreography(data, len, &staging_pool)) {
+    reject_count++;
+    return;  // Early Exit!
+  }
+
+  // Swap in the whole table at once
+  taskENTER_CRITICAL();
+  active_pool = staging_pool;
+  taskEXIT_CRITICAL();
+  printf("Choreography loaded, %u routines, hash %08" PRIx32 "\n",
+         (unsigned int)staging_pool.routine_count, staging_pool.hash);
+}
+
+bool choreography_loaded() { return active_pool.routine_count != 0; }
+
+uint32_t get_choreography_hash() { return active_pool.hash; }
+
+size_t get_choreography_routine_count() { return active_pool.routine_count; }
+
+uint32_t get_choreography_reject_count() { return reject_count; }
+
+bool choreography_get_move(uint32_t hash, size_t routine, size_t index, struct DanceMove *move) {
+  bool found = false;
+
+  taskENTER_CRITICAL();
+  if ((active_pool.hash == hash) && (routine < active_pool.routine_count) &&
+      (index < active_pool.routine_size[routine])) {
+    *move = active_pool.moves[active_pool.routine_start[routine] + index];
+    found = true;
+  }
+  taskEXIT_CRITICAL();
+
+  return found;
+}
+
+void expand_dance_move(const struct DanceMove *move, uint32_t seed, struct MotorCommand *mc) {
+  memset(mc, 0, sizeof(struct MotorCommand));
+
+  double heading = (double)move->heading_ddeg / 10.0;
+  if (move->flags & MOVE_FLAG_RANDOM_HEADING) {
+    heading = (double)(seed % 360);
+  }
+
+  mc->type = (enum MotorCommandType)move->type;
+  mc->remaining_time_ms = (uint32_t)move->duration_ds * 100;
+
+  switch (mc->type) {
+    case MOTOR:
+      mc->motor_right_duty_cycle = (double)move->right_duty_pm / 1000.0;
+      mc->motor_left_duty_cycle = (double)move->left_duty_pm / 1000.0;
+      break;
+    case SWIM:
+      mc->Kp = Kp;
+      mc->Kd = Kd;
+      // Fall through!
+    case POINT:
+      mc->desired_heading = heading;
+      break;
+    case FLOAT:
+      // All zeroes
+      break;
+    default:
+      memset(mc, 0, sizeof(struct MotorCommand));
+  }
+}
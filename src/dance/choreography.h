@@ -0,0 +1,42 @@
+#ifndef _DD_CHOREOGRAPHY_H
+#define _DD_CHOREOGRAPHY_H
+
+#include "FreeRTOS.h"
+
+#include "commanding.h"
+#include "stdint.h"
+
+enum DanceMoveFlags {
+  MOVE_FLAG_RANDOM_HEADING = 0x01,
+};
+
+// Compact dance move, expanded into a MotorCommand only when issued
+// Wire format is the same fields, in order, little endian (10 bytes)
+struct DanceMove {
+  uint8_t type;           // enum MotorCommandType
+  uint8_t flags;          // enum DanceMoveFlags
+  uint16_t duration_ds;   // Tenths of a second, matches motor loop resolution
+  int16_t right_duty_pm;  // Per mille, MOTOR only
+  int16_t left_duty_pm;   // Per mille, MOTOR only
+  int16_t heading_ddeg;   // Tenths of a degree, POINT and SWIM only
+};
+
+// Validate a complete choreography payload and swap it in, a bad table is rejected whole
+void choreography_load(const uint8_t *data, size_t len);
+
+// True once a downloaded table has replaced the built-in routines
+bool choreography_loaded();
+
+// FNV-1a hash of the active table payload, 0 when running built-in routines
+uint32_t get_choreography_hash();
+size_t get_choreography_routine_count();
+uint32_t get_choreography_reject_count();
+
+// Copy a single move out of the active table
+// Fails if the table no longer matches hash, so a routine never mixes two tables
+bool choreography_get_move(uint32_t hash, size_t routine, size_t index, struct DanceMove *move);
+
+// Seed is only used for moves with a random heading
+void expand_dance_move(const struct DanceMove *move, uint32_t seed, struct MotorCommand *mc);
+
+#endif
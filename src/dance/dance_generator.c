@@ -3,137 +3,121 @@
 #include "FreeRTOS.h"
 
 #include "pico/printf.h"
+#include "pico/stdlib.h"
 
+#include "choreography.h"
 #include "commanding.h"
 #include "config.h"
 #include "dance_time.h"
+#include "motor.h"
 #include "queue.h"
 #include "stdint.h"
+#include "task.h"
 
 static const bool DEBUG_PRINT = true;
 static const uint32_t DANCE_TRIGGER_INTERVAL_S = 120;
-static const size_t NUM_DANCES = 7;
+// MID_DUTY_CYCLE in per mille, tables must be compile time constants
+enum { MID_DUTY_PM = 800 };
 
 struct DanceRoutine {
-  struct MotorCommand *mc_array;
+  const struct DanceMove *moves;
   size_t size;
 };
 
-static struct DanceRoutine *dance_program;
-static int current_dance = 0;
-static int dance_count = 0;
-static uint32_t wind_correction_counter = 0;
-
-int get_current_dance() { return current_dance; }
+static const struct DanceMove BOX_DANCE[] = {
+    {.type = SWIM, .duration_ds = 200, .heading_ddeg = 3600},
+    {.type = FLOAT, .duration_ds = 100},
+    {.type = SWIM, .duration_ds = 200, .heading_ddeg = 2700},
+    {.type = FLOAT, .duration_ds = 100},
+    {.type = SWIM, .duration_ds = 200, .heading_ddeg = 1800},
+    {.type = FLOAT, .duration_ds = 100},
+    {.type = SWIM, .duration_ds = 200, .heading_ddeg = 900},
+    {.type = FLOAT, .duration_ds = 100},
+};
 
-int get_dance_count() { return dance_count; }
+static const struct DanceMove BACK_AND_FORTH_DANCE[] = {
+    {.type = MOTOR, .duration_ds = 200, .right_duty_pm = MID_DUTY_PM},
+    {.type = FLOAT, .duration_ds = 150},
+    {.type = MOTOR, .duration_ds = 200, .left_duty_pm = MID_DUTY_PM},
+};
 
-static void create_empty_dance_routine(struct DanceRoutine *dance, size_t size) {
-  dance->mc_array = (struct MotorCommand *)pvPortMalloc(sizeof(struct MotorCommand) * size);
-  memset(dance->mc_array, 0, sizeof(struct MotorCommand) * size);
-  dance->size = size;
-}
+static const struct DanceMove POINT_DANCE[] = {
+    {.type = POINT, .duration_ds = 250, .heading_ddeg = 450},
+    {.type = FLOAT, .duration_ds = 100},
+    {.type = POINT, .duration_ds = 250, .heading_ddeg = 1350},
+    {.type = FLOAT, .duration_ds = 100},
+    {.type = POINT, .duration_ds = 250, .heading_ddeg = 2250},
+    {.type = FLOAT, .duration_ds = 100},
+    {.type = POINT, .duration_ds = 250, .heading_ddeg = 3150},
+    {.type = FLOAT, .duration_ds = 100},
+};
 
-static void create_motor_movement(struct MotorCommand *mc, double right_duty, double left_duty,
-                                  uint32_t duration_ms) {
-  mc->type = MOTOR;
-  mc->motor_right_duty_cycle = right_duty;
-  mc->motor_left_duty_cycle = left_duty;
-  mc->remaining_time_ms = duration_ms;
-}
+static const struct DanceMove SPIN_DANCE[] = {
+    {.type = MOTOR, .duration_ds = 200, .right_duty_pm = MID_DUTY_PM},
+    {.type = FLOAT, .duration_ds = 50},
+    {.type = MOTOR, .duration_ds = 200, .right_duty_pm = MID_DUTY_PM},
+};
 
-static void create_point_movement(struct MotorCommand *mc, double heading, uint32_t duration_ms) {
-  mc->type = POINT;
-  mc->desired_heading = heading;
-  mc->remaining_time_ms = duration_ms;
-}
+static const struct DanceMove UP_AND_DOWN_DANCE[] = {
+    {.type = SWIM, .duration_ds = 200, .heading_ddeg = 3600},
+    {.type = FLOAT, .duration_ds = 25},
+    {.type = SWIM, .duration_ds = 200, .heading_ddeg = 1800},
+};
 
-static void create_swim_movement(struct MotorCommand *mc, double heading, uint32_t duration_ms) {
-  mc->type = SWIM;
-  mc->desired_heading = heading;
-  mc->Kp = Kp;
-  mc->Kd = Kd;
-  mc->remaining_time_ms = duration_ms;
-}
+static const struct DanceMove FIGURE_EIGHT_DANCE[] = {
+    {.type = MOTOR, .duration_ds = 100, .right_duty_pm = MID_DUTY_PM},
+    {.type = MOTOR, .duration_ds = 100, .left_duty_pm = MID_DUTY_PM},
+    {.type = MOTOR, .duration_ds = 100, .right_duty_pm = MID_DUTY_PM},
+    {.type = MOTOR, .duration_ds = 100, .left_duty_pm = MID_DUTY_PM},
+    {.type = MOTOR, .duration_ds = 100, .right_duty_pm = MID_DUTY_PM},
+    {.type = MOTOR, .duration_ds = 100, .left_duty_pm = MID_DUTY_PM},
+    {.type = MOTOR, .duration_ds = 100, .right_duty_pm = MID_DUTY_PM},
+    {.type = MOTOR, .duration_ds = 100, .left_duty_pm = MID_DUTY_PM},
+};
 
-static void create_float_movement(struct MotorCommand *mc, uint32_t duration_ms) {
-  mc->type = FLOAT;
-  mc->remaining_time_ms = duration_ms;
-}
+static const struct DanceMove SIDE_TO_SIDE_DANCE[] = {
+    {.type = SWIM, .duration_ds = 200, .heading_ddeg = 900},
+    {.type = FLOAT, .duration_ds = 25},
+    {.type = SWIM, .duration_ds = 200, .heading_ddeg = 2700},
+};
 
-static void create_box_dance(struct DanceRoutine *dance) {
-  create_empty_dance_routine(dance, 8);
-  create_swim_movement(&dance->mc_array[0], 360.0, 20000);
-  create_float_movement(&dance->mc_array[1], 10000);
-  create_swim_movement(&dance->mc_array[2], 270.0, 20000);
-  create_float_movement(&dance->mc_array[3], 10000);
-  create_swim_movement(&dance->mc_array[4], 180.0, 20000);
-  create_float_movement(&dance->mc_array[5], 10000);
-  create_swim_movement(&dance->mc_array[6], 90.0, 20000);
-  create_float_movement(&dance->mc_array[7], 10000);
-}
+#define DANCE_ROUTINE(moves) {(moves), sizeof(moves) / sizeof((moves)[0])}
 
-static void create_back_and_forth_dance(struct DanceRoutine *dance) {
-  create_empty_dance_routine(dance, 3);
-  create_motor_movement(&dance->mc_array[0], MID_DUTY_CYCLE, 0.0, 20000);
-  create_float_movement(&dance->mc_array[1], 15000);
-  create_motor_movement(&dance->mc_array[2], 0.0, MID_DUTY_CYCLE, 20000);
-}
+// Built-in routines live in flash and are expanded one move at a time when issued
+static const struct DanceRoutine DANCE_PROGRAM[] = {
+    DANCE_ROUTINE(BOX_DANCE),         DANCE_ROUTINE(BACK_AND_FORTH_DANCE),
+    DANCE_ROUTINE(POINT_DANCE),       DANCE_ROUTINE(SPIN_DANCE),
+    DANCE_ROUTINE(UP_AND_DOWN_DANCE), DANCE_ROUTINE(FIGURE_EIGHT_DANCE),
+    DANCE_ROUTINE(SIDE_TO_SIDE_DANCE),
+};
 
-static void create_spin_dance(struct DanceRoutine *dance) {
-  create_empty_dance_routine(dance, 3);
-  create_motor_movement(&dance->mc_array[0], MID_DUTY_CYCLE, 0.0, 20000);
-  create_float_movement(&dance->mc_array[1], 5000);
-  create_motor_movement(&dance->mc_array[2], MID_DUTY_CYCLE, 0.0, 20000);
-}
+static const size_t NUM_DANCES = sizeof(DANCE_PROGRAM) / sizeof(DANCE_PROGRAM[0]);
 
-static void create_point_dance(struct DanceRoutine *dance) {
-  create_empty_dance_routine(dance, 8);
-  create_point_movement(&dance->mc_array[0], 45.0, 25000);
-  create_float_movement(&dance->mc_array[1], 10000);
-  create_point_movement(&dance->mc_array[2], 135.0, 25000);
-  create_float_movement(&dance->mc_array[3], 10000);
-  create_point_movement(&dance->mc_array[4], 225.0, 25000);
-  create_float_movement(&dance->mc_array[5], 10000);
-  create_point_movement(&dance->mc_array[6], 315.0, 25000);
-  create_float_movement(&dance->mc_array[7], 10000);
-}
+// Sequencer cursor, written by the dance task and advanced by the motor task
+struct DanceCursor {
+  uint32_t hash;
+  size_t routine;
+  size_t index;
+  uint32_t generation;
+  uint32_t started_us;
+  bool active;
+};
 
-static void create_figure_eight_dance(struct DanceRoutine *dance) {
-  create_empty_dance_routine(dance, 8);
-  create_motor_movement(&dance->mc_array[0], MID_DUTY_CYCLE, 0.0, 10000);
-  create_motor_movement(&dance->mc_array[1], 0.0, MID_DUTY_CYCLE, 10000);
-  create_motor_movement(&dance->mc_array[2], MID_DUTY_CYCLE, 0.0, 10000);
-  create_motor_movement(&dance->mc_array[3], 0.0, MID_DUTY_CYCLE, 10000);
-  create_motor_movement(&dance->mc_array[4], MID_DUTY_CYCLE, 0.0, 10000);
-  create_motor_movement(&dance->mc_array[5], 0.0, MID_DUTY_CYCLE, 10000);
-  create_motor_movement(&dance->mc_array[6], MID_DUTY_CYCLE, 0.0, 10000);
-  create_motor_movement(&dance->mc_array[7], 0.0, MID_DUTY_CYCLE, 10000);
-}
+static struct DanceCursor cursor = {0};
+static int current_dance = 0;
+static int dance_count = 0;
+static uint32_t wind_correction_counter = 0;
 
-static void create_up_and_down_dance(struct DanceRoutine *dance) {
-  create_empty_dance_routine(dance, 3);
-  create_swim_movement(&dance->mc_array[0], 360.0, 20000);
-  create_float_movement(&dance->mc_array[1], 2500);
-  create_swim_movement(&dance->mc_array[2], 180.0, 20000);
-}
+int get_current_dance() { return current_dance; }
 
-static void create_side_to_side_dance(struct DanceRoutine *dance) {
-  create_empty_dance_routine(dance, 3);
-  create_swim_movement(&dance->mc_array[0], 90.0, 20000);
-  create_float_movement(&dance->mc_array[1], 2500);
-  create_swim_movement(&dance->mc_array[2], 270.0, 20000);
-}
+int get_dance_count() { return dance_count; }
 
-void init_dance_program() {
-  dance_program = (struct DanceRoutine *)pvPortMalloc(sizeof(struct DanceRoutine) * NUM_DANCES);
-  create_box_dance(&dance_program[0]);
-  create_back_and_forth_dance(&dance_program[1]);
-  create_point_dance(&dance_program[2]);
-  create_spin_dance(&dance_program[3]);
-  create_up_and_down_dance(&dance_program[4]);
-  create_figure_eight_dance(&dance_program[5]);
-  create_side_to_side_dance(&dance_program[6]);
+static void create_swim_movement(struct MotorCommand *mc, double heading, uint32_t duration_ms) {
+  mc->type = SWIM;
+  mc->desired_heading = heading;
+  mc->Kp = Kp;
+  mc->Kd = Kd;
+  mc->remaining_time_ms = duration_ms;
 }
 
 static uint32_t time_based_prng(uint32_t time_seconds) {
@@ -151,20 +135,18 @@ static uint32_t time_based_prng(uint32_t time_seconds) {
   return state;
 }
 
-extern uint32_t motor_queue_error;
-
 uint32_t get_wind_correction_counter() { return wind_correction_counter; }
 
-void wind_correction_generator(struct WindCorrection *wc, QueueHandle_t motor_queue,
+// Corrections pre-empt dance moves, and a newer correction replaces one not yet started
+void wind_correction_generator(struct WindCorrection *wc, QueueHandle_t corrective_mailbox,
                                uint32_t current_second) {
   if (wc->enabled && (current_second % wc->correction_interval_s == 0)) {
     struct MotorCommand mc = {0};
     create_swim_movement(&mc, wc->windward_direction, wc->correction_duration_s * 1000);
-    if (xQueueSendToBack(motor_queue, &mc, 0) != pdTRUE) {
-      motor_queue_error++;
-    } else {
-      wind_correction_counter++;
-    }
+    mc.received_us = time_us_32();
+    xQueueOverwrite(corrective_mailbox, &mc);
+    wake_motor_task();
+    wind_correction_counter++;
     if (DEBUG_PRINT) {
       printf("Wind correction of %f degrees, for %" PRIu32 " seconds\n", wc->windward_direction,
              wc->correction_duration_s);
@@ -172,33 +154,93 @@ void wind_correction_generator(struct WindCorrection *wc, QueueHandle_t motor_qu
   }
 }
 
-void dance_generator(QueueHandle_t motor_queue, uint32_t current_second) {
+// A hash of 0 selects the built-in routines
+static bool get_dance_move(uint32_t hash, size_t routine, size_t index, struct DanceMove *move) {
+  if (hash) {
+    return choreography_get_move(hash, routine, index, move);
+  }
+  if ((routine < NUM_DANCES) && (index < DANCE_PROGRAM[routine].size)) {
+    *move = DANCE_PROGRAM[routine].moves[index];
+    return true;
+  }
+  return false;
+}
+
+static void start_dance_routine(uint32_t hash, size_t routine) {
+  taskENTER_CRITICAL();
+  cursor.hash = hash;
+  cursor.routine = routine;
+  cursor.index = 0;
+  cursor.generation++;
+  cursor.started_us = time_us_32();
+  cursor.active = true;
+  taskEXIT_CRITICAL();
+
+  wake_motor_task();
+}
+
+void stop_dance_sequencer() {
+  taskENTER_CRITICAL();
+  cursor.active = false;
+  cursor.generation++;
+  taskEXIT_CRITICAL();
+}
+
+uint32_t get_dance_sequencer_generation() { return cursor.generation; }
+
+// Downloaded routines end early if the table is swapped mid routine
+bool next_dance_move(struct MotorCommand *mc, uint32_t *generation) {
+  taskENTER_CRITICAL();
+  struct DanceCursor position = cursor;
+  cursor.index++;
+  taskEXIT_CRITICAL();
+
+  struct DanceMove move;
+  if (!position.active ||
+      !get_dance_move(position.hash, position.routine, position.index, &move)) {
+    // End of routine, unless a new one started in the meantime
+    taskENTER_CRITICAL();
+    if (cursor.generation == position.generation) {
+      cursor.active = false;
+    }
+    taskEXIT_CRITICAL();
+    return false;
+  }
+
+  expand_dance_move(&move, time_based_prng(xTaskGetTickCount()), mc);
+  // Latency of the first move measures how quickly a new dance pre-empts the old one
+  mc->received_us = (position.index == 0) ? position.started_us : time_us_32();
+  *generation = position.generation;
+  return true;
+}
+
+void dance_generator(uint32_t current_second) {
   // Send periodically
   if (current_second % DANCE_TRIGGER_INTERVAL_S == 0) {
+    uint32_t hash = get_choreography_hash();
+    size_t num_dances = NUM_DANCES;
+    if (hash) {
+      num_dances = get_choreography_routine_count();
+    }
+
     int dance_index;
     if (current_second % (DANCE_TRIGGER_INTERVAL_S * 2) == 0) {
       // Synchronized Dance
-      dance_index = (current_second / (DANCE_TRIGGER_INTERVAL_S * 2)) % NUM_DANCES;
+      dance_index = (current_second / (DANCE_TRIGGER_INTERVAL_S * 2)) % num_dances;
       if (DEBUG_PRINT) {
         printf("Synchronized Dance Sent\n");
       }
     } else {
       // Free Style Dance
-      dance_index = time_based_prng(xTaskGetTickCount()) % NUM_DANCES;
+      dance_index = time_based_prng(xTaskGetTickCount()) % num_dances;
       if (DEBUG_PRINT) {
         printf("Free Style Dance Sent\n");
       }
     }
 
-    struct DanceRoutine *dance = &dance_program[dance_index];
-
-    for (size_t i = 0; i < dance->size; i++) {
-      if (xQueueSendToBack(motor_queue, &dance->mc_array[i], 0) != pdTRUE) {
-        motor_queue_error++;
-      }
-    }
+    start_dance_routine(hash, dance_index);
 
     current_dance = dance_index;
     dance_count++;
   }
-}
\ No newline at end of file
+}
@@ -3,6 +3,7 @@
 
 #include "FreeRTOS.h"
 
+#include "commanding.h"
 #include "queue.h"
 #include "stdint.h"
 
@@ -13,12 +14,17 @@ struct WindCorrection {
   bool enabled;
 };
 
-void init_dance_program();
 int get_current_dance();
 int get_dance_count();
 uint32_t get_wind_correction_counter();
-void dance_generator(QueueHandle_t motor_queue, uint32_t current_second);
-void wind_correction_generator(struct WindCorrection *wc, QueueHandle_t motor_queue,
+
+// Sequencer, the motor task pulls dance moves one at a time as each expires
+bool next_dance_move(struct MotorCommand *mc, uint32_t *generation);
+void stop_dance_sequencer();
+// Changes whenever a dance starts or stops, so the move in progress can be pre-empted
+uint32_t get_dance_sequencer_generation();
+void dance_generator(uint32_t current_second);
+void wind_correction_generator(struct WindCorrection *wc, QueueHandle_t corrective_mailbox,
                                uint32_t current_second);
 
 #endif
\ No newline at end of file
@@ -76,7 +76,7 @@ static uint32_t calculate_sleep_ticks(struct CurrentTime *ct) {
 
 // Must be called from FreeRTOS task
 // Has early exits!
-void set_dance_server_time_ms(const char *data, uint16_t len) {
+void set_dance_server_time_ms(const char *data, uint16_t len, uint32_t received_us) {
   // Convert string to time
   if (len > (10 + 1)) {
     printf("String too long for uint32_t and terminating character\n");
@@ -97,7 +97,9 @@ void set_dance_server_time_ms(const char *data, uint16_t len) {
     return;
   }
 
-  tick_count_last_update = xTaskGetTickCount();
+  // The time was current when the publish arrived, not when the command task got to it
+  uint32_t queued_ms = (time_us_32() - received_us) / 1000;
+  tick_count_last_update = xTaskGetTickCount() - pdMS_TO_TICKS(queued_ms);
   server_time_last_update_ms = time_ms;
   server_time_set = true;
   if (DEBUG_PRINT) {
@@ -119,6 +121,18 @@ uint32_t get_dance_server_time_calc_ms() {
   return 0;
 }
 
+// Server time now, false until the server has sent it
+// This function has early exits
+bool get_server_time_ms(uint32_t *now_ms) {
+  if (!server_time_set) {
+    return false;  // Early Exit!
+  }
+  struct CurrentTime ct;
+  get_current_time_ms(&ct);
+  *now_ms = ct.current_time_ms;
+  return true;
+}
+
 void reset_dance_time() {
   tick_count_last_update = 0;
   server_time_last_update_ms = 0;
@@ -131,7 +145,6 @@ void reset_dance_time() {
 // Assumes tick is millisecond based
 void vDanceTimeTask(void *pvParameters) {
   struct DanceTimeParameters *dtp = (struct DanceTimeParameters *)pvParameters;
-  init_dance_program();
 
   struct WindCorrection wc = {0};
 
@@ -150,10 +163,11 @@ void vDanceTimeTask(void *pvParameters) {
     // Check if we are in valid half interval window
     if (check_half_interval_window(&ct) && (dm == DANCE)) {
       // Run Dance Generator
-      dance_generator(dtp->motor_queue, ct.current_time_ms / TIME_INTERVAL_MS);
+      dance_generator(ct.current_time_ms / TIME_INTERVAL_MS);
 
       // Apply Wind Correction
-      wind_correction_generator(&wc, dtp->motor_queue, ct.current_time_ms / TIME_INTERVAL_MS);
+      wind_correction_generator(&wc, dtp->corrective_mailbox,
+                                ct.current_time_ms / TIME_INTERVAL_MS);
     }
 
     vTaskDelay(calculate_sleep_ticks(&ct));
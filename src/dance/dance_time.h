@@ -5,18 +5,21 @@
 
 #include "dance_generator.h"
 #include "queue.h"
+#include "stdbool.h"
 #include "stdint.h"
 
 struct DanceTimeParameters {
-  QueueHandle_t motor_queue;
+  QueueHandle_t corrective_mailbox;
   QueueHandle_t duck_mode_mailbox;
   QueueHandle_t wind_mailbox;
 };
 
 void reset_dance_time();
-void set_dance_server_time_ms(const char *data, uint16_t len);
+// received_us is time_us_32() when the publish arrived
+void set_dance_server_time_ms(const char *data, uint16_t len, uint32_t received_us);
 uint32_t get_dance_server_time_raw_ms();
 uint32_t get_dance_server_time_calc_ms();
+bool get_server_time_ms(uint32_t *now_ms);
 void vDanceTimeTask(void *pvParameters);
 
 #endif
\ No newline at end of file
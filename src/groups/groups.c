@@ -0,0 +1,76 @@
+#include <inttypes.h>
+#include <string.h>
+
+#include "FreeRTOS.h"
+
+#include "pico/flash.h"
+#include "pico/printf.h"
+#include "pico/stdlib.h"
+
+#include "groups.h"
+#include "hardware/flash.h"
+#include "stdint.h"
+
+static const uint32_t GROUPS_MAGIC_NUM = 0x6D0C6D0C;
+static const uint32_t FLASH_SAFE_TIMEOUT_MS = 100;
+
+// Last sector of flash, clear of the picowota bootloader and application images
+static const uint32_t GROUPS_FLASH_OFFSET = PICO_FLASH_SIZE_BYTES - FLASH_SECTOR_SIZE;
+
+struct GroupRecord {
+  uint32_t magic;
+  uint32_t mask;
+  uint32_t mask_inverted;  // Guards against a torn or erased record
+};
+
+static uint32_t group_mask = 0;
+static uint32_t save_error_count = 0;
+
+static const struct GroupRecord *get_flash_record() {
+  return (const struct GroupRecord *)(uintptr_t)(XIP_BASE + GROUPS_FLASH_OFFSET);
+}
+
+void groups_init() {
+  const struct GroupRecord *record = get_flash_record();
+  if ((record->magic == GROUPS_MAGIC_NUM) && (record->mask == ~record->mask_inverted)) {
+    group_mask = record->mask;
+  }
+  printf("Group mask: %08" PRIx32 "\n", group_mask);
+}
+
+uint32_t get_group_mask() { return group_mask; }
+
+bool is_group_member(uint32_t group) {
+  return (group < MAX_GROUPS) && (group_mask & (1u << group));
+}
+
+uint32_t get_group_save_error_count() { return save_error_count; }
+
+// Runs with the other core and interrupts held off by flash_safe_execute
+static void write_group_record(void *param) {
+  static uint8_t page[FLASH_PAGE_SIZE];
+  memset(page, 0xFF, sizeof(page));
+  memcpy(page, param, sizeof(struct GroupRecord));
+
+  flash_range_erase(GROUPS_FLASH_OFFSET, FLASH_SECTOR_SIZE);
+  flash_range_program(GROUPS_FLASH_OFFSET, page, FLASH_PAGE_SIZE);
+}
+
+// This function has early exits
+bool set_group_mask(uint32_t mask) {
+  group_mask = mask;
+
+  const struct GroupRecord *saved = get_flash_record();
+  if ((saved->magic == GROUPS_MAGIC_NUM) && (saved->mask == mask) &&
+      (saved->mask_inverted == ~mask)) {
+    return true;  // Early Exit!
+  }
+
+  struct GroupRecord record = {GROUPS_MAGIC_NUM, mask, ~mask};
+  if (flash_safe_execute(write_group_record, &record, FLASH_SAFE_TIMEOUT_MS) != PICO_OK) {
+    printf("Group save failed\n");
+    save_error_count++;
+    return false;
+  }
+  return true;
+}
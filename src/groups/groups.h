@@ -0,0 +1,23 @@
+#ifndef _DD_GROUPS_H
+#define _DD_GROUPS_H
+
+#include <stdbool.h>
+
+#include "stdint.h"
+
+// Group g is bit g of the membership mask
+enum { MAX_GROUPS = 32 };
+
+// Load memberships saved in flash, call once before connecting to MQTT
+void groups_init();
+
+uint32_t get_group_mask();
+bool is_group_member(uint32_t group);
+
+// Replace the memberships and save them to flash if they changed
+// Blocks both cores for a sector erase, do not call from time critical tasks
+bool set_group_mask(uint32_t mask);
+
+uint32_t get_group_save_error_count();
+
+#endif
@@ -0,0 +1,162 @@
+#include <inttypes.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "FreeRTOS.h"
+
+#include "pico/printf.h"
+#include "pico/stdlib.h"
+
+#include "hardware/sync.h"
+#include "log.h"
+#include "mqtt.h"
+#include "publish.h"
+#include "task.h"
+#include "trace.h"
+
+static const enum LogLevel LOG_UART_LEVEL = LOG_INFO;
+static const enum LogLevel LOG_MQTT_LEVEL = LOG_WARN;
+static const uint32_t LOG_DRAIN_PERIOD_MS = 50;
+enum { LOG_RING_DEPTH = 64, LOG_CORES = 2, LOG_LINE_SIZE = 128, LOG_MQTT_BUFFER_SIZE = 512 };
+
+struct LogFormatInfo {
+  enum LogLevel level;
+  const char *format;  // Up to three 32 bit arguments
+};
+
+static const struct LogFormatInfo LOG_FORMATS[NUM_LOG_FORMATS] = {
+    [LOG_PET_WATCHDOG] = {LOG_INFO, "Pet Watchdog"},
+    [LOG_MOTOR_STOPPED] = {LOG_INFO, "Motor Stopped!"},
+    [LOG_MOTOR_STOP_TAKE_ERROR] = {LOG_ERROR, "Motor Stop Semaphore take failed"},
+    [LOG_MOTOR_STOP_PENDING] = {LOG_DEBUG, "Motor Stop already pending"},
+    [LOG_OVERRIDE_LOADED] = {LOG_INFO, "Override Command Type: %" PRIu32 ", Duration: %" PRIu32},
+    [LOG_CORRECTIVE_LOADED] = {LOG_INFO,
+                               "Corrective Command Type: %" PRIu32 ", Duration: %" PRIu32},
+    [LOG_DANCE_LOADED] = {LOG_INFO, "Dance Command Type: %" PRIu32 ", Duration: %" PRIu32},
+    [LOG_ACK_QUEUE_FULL] = {LOG_WARN, "Ack queue full"},
+    [LOG_DRV_FAULT] = {LOG_ERROR, "DRV Fault!"},
+    [LOG_COMMAND_RECEIVED] = {LOG_INFO, "Command Received: %s"},
+    [LOG_COMMAND_TOO_LARGE] = {LOG_WARN, "Command payload too large, limit %" PRIu32 " bytes"},
+    [LOG_PAYLOAD_IGNORED] = {LOG_DEBUG, "mqtt_incoming_data_cb: Ignoring payload..."},
+    [LOG_PUBLISH_RESULT] = {LOG_WARN, "Publish result: %" PRIi32},
+    [LOG_SUBSCRIBE_RESULT] = {LOG_INFO, "Subscribe result: %" PRIi32},
+};
+
+static const char *LOG_LEVEL_NAMES[] = {
+    [LOG_DEBUG] = "DEBUG",
+    [LOG_INFO] = "INFO",
+    [LOG_WARN] = "WARN",
+    [LOG_ERROR] = "ERROR",
+};
+
+struct LogRecord {
+  uint32_t time_us;
+  uint16_t id;
+  uint8_t core;
+  uint32_t args[3];
+};
+
+/*
+ * One ring per core, so each ring has a single producer and the log task as its only consumer
+ * The M0+ has no compare and swap, instead a producer masks interrupts on its own core while it
+ * writes a record. The other core is never waited on and the log task never locks a producer out.
+ */
+struct LogRing {
+  volatile uint32_t head;  // Written by the producing core
+  volatile uint32_t tail;  // Written by the log task
+  uint32_t overflow_count;
+  struct LogRecord records[LOG_RING_DEPTH];
+};
+
+static struct LogRing log_rings[LOG_CORES];
+
+uint32_t get_log_overflow_count() {
+  return log_rings[0].overflow_count + log_rings[1].overflow_count;
+}
+
+// This function has early exits
+void log_event(enum LogFormat id, uint32_t arg0, uint32_t arg1, uint32_t arg2) {
+  enum LogLevel level = LOG_FORMATS[id].level;
+  if ((level < LOG_UART_LEVEL) && (level < LOG_MQTT_LEVEL)) {
+    return;  // Early Exit!
+  }
+
+  uint32_t irq_state = save_and_disable_interrupts();
+  uint core = get_core_num();
+  struct LogRing *ring = &log_rings[core];
+  if (ring->head - ring->tail >= LOG_RING_DEPTH) {
+    ring->overflow_count++;
+  } else {
+    struct LogRecord *record = &ring->records[ring->head % LOG_RING_DEPTH];
+    record->time_us = time_us_32();
+    record->id = (uint16_t)id;
+    record->core = (uint8_t)core;
+    record->args[0] = arg0;
+    record->args[1] = arg1;
+    record->args[2] = arg2;
+    // Record must be complete before the log task can see it
+    __dmb();
+    ring->head++;
+  }
+  restore_interrupts(irq_state);
+}
+
+// This function has early exits
+static bool take_record(struct LogRing *ring, struct LogRecord *record) {
+  if (ring->tail == ring->head) {
+    return false;  // Early Exit!
+  }
+  __dmb();
+  *record = ring->records[ring->tail % LOG_RING_DEPTH];
+  __dmb();
+  ring->tail++;
+  return true;
+}
+
+static size_t format_record(const struct LogRecord *record, char *line, size_t size) {
+  const struct LogFormatInfo *info = &LOG_FORMATS[record->id];
+  int len = snprintf(line, size, "%10" PRIu32 " C%u %s ", record->time_us,
+                     (unsigned int)record->core, LOG_LEVEL_NAMES[info->level]);
+  if ((len > 0) && ((size_t)len < size)) {
+    int body = snprintf(&line[len], size - (size_t)len, info->format, record->args[0],
+                        record->args[1], record->args[2]);
+    len += (body > 0) ? body : 0;
+  }
+  return ((len > 0) && ((size_t)len < size)) ? (size_t)len : size - 1;
+}
+
+void vLogTask(void *pvParameters) {
+  struct LogTaskParameters *params = (struct LogTaskParameters *)pvParameters;
+  static char mqtt_buffer[LOG_MQTT_BUFFER_SIZE];
+
+  for (;;) {
+    size_t mqtt_len = 0;
+
+    for (size_t core = 0; core < LOG_CORES; core++) {
+      struct LogRecord record;
+      while (take_record(&log_rings[core], &record)) {
+        char line[LOG_LINE_SIZE];
+        size_t len = format_record(&record, line, sizeof(line));
+        enum LogLevel level = LOG_FORMATS[record.id].level;
+
+        if (level >= LOG_UART_LEVEL) {
+          printf("%s\n", line);
+        }
+        // Lines that do not fit are only sent to UART
+        if ((level >= LOG_MQTT_LEVEL) && (mqtt_len + len + 1 <= sizeof(mqtt_buffer))) {
+          memcpy(&mqtt_buffer[mqtt_len], line, len);
+          mqtt_len += len;
+          mqtt_buffer[mqtt_len++] = '\n';
+        }
+      }
+    }
+
+    if ((mqtt_len > 0) && (params->client != NULL) && is_mqtt_connected()) {
+      publish_log(params->client, mqtt_buffer, mqtt_len);
+    }
+    // One chunk per pass, so a UART trace dump never holds up the log lines
+    print_trace_chunk();
+
+    vTaskDelay(LOG_DRAIN_PERIOD_MS);
+  }
+}
@@ -0,0 +1,41 @@
+#ifndef _DD_LOG_H
+#define _DD_LOG_H
+
+#include "lwip/apps/mqtt.h"
+
+#include "stdint.h"
+
+enum LogLevel { LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR };
+
+// One id per message, the level and format string live in LOG_FORMATS in log.c
+enum LogFormat {
+  LOG_PET_WATCHDOG,
+  LOG_MOTOR_STOPPED,
+  LOG_MOTOR_STOP_TAKE_ERROR,
+  LOG_MOTOR_STOP_PENDING,
+  LOG_OVERRIDE_LOADED,
+  LOG_CORRECTIVE_LOADED,
+  LOG_DANCE_LOADED,
+  LOG_ACK_QUEUE_FULL,
+  LOG_DRV_FAULT,
+  LOG_COMMAND_RECEIVED,
+  LOG_COMMAND_TOO_LARGE,
+  LOG_PAYLOAD_IGNORED,
+  LOG_PUBLISH_RESULT,
+  LOG_SUBSCRIBE_RESULT,
+  NUM_LOG_FORMATS
+};
+
+struct LogTaskParameters {
+  mqtt_client_t *client;
+};
+
+// Never blocks, safe from any task or interrupt on either core, a full ring drops the record
+// Arguments are formatted by the log task, so a %s argument must point to a string literal
+void log_event(enum LogFormat id, uint32_t arg0, uint32_t arg1, uint32_t arg2);
+uint32_t get_log_overflow_count();
+
+// Formats records to UART, and sends warnings and errors to the log topic
+void vLogTask(void *pvParameters);
+
+#endif
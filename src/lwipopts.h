@@ -103,6 +103,7 @@
 #endif
 
 // MQTT
-#define MQTT_REQ_MAX_IN_FLIGHT 64
+#define MQTT_REQ_MAX_IN_FLIGHT   64
+#define MQTT_OUTPUT_RINGBUF_SIZE 2048  // Room for a full telemetry frame, default is 256
 
 #endif /* __LWIPOPTS_H__ */
\ No newline at end of file
@@ -7,16 +7,21 @@
 
 #include "config.h"
 #include "hardware/watchdog.h"
+#include "latency.h"
 #include "lis2mdl.h"
 #include "magnetometer.h"
 #include "math.h"
 #include "queue.h"
 #include "semphr.h"
 #include "task.h"
+#include "trace.h"
 
 static struct CircleCenter calibration_offset_checked;
 static struct CircleCenter calibration_offset_raw;
 static uint32_t set_mailbox_error_count = 0;
+static uint32_t stream_drop_count = 0;
+static volatile bool stream_active = false;
+static volatile TickType_t stream_end_tick = 0;
 static float* watchdog_scratch_x_cal = (float*)&watchdog_hw->scratch[3];
 static float* watchdog_scratch_y_cal = (float*)&watchdog_hw->scratch[7];
 
@@ -165,6 +170,39 @@ void run_calibration(double* x_vals_uT, double* y_vals_uT, struct MagXYZ* mag,
 
 uint32_t get_mag_mailbox_set_error_count() { return set_mailbox_error_count; }
 
+uint32_t get_mag_stream_drop_count() { return stream_drop_count; }
+
+bool is_mag_stream_active() { return stream_active; }
+
+// Called from the command task, a new request restarts the stream's timer
+void start_mag_stream(uint32_t duration_s) {
+  if (duration_s == 0) {
+    duration_s = MAG_STREAM_DEFAULT_S;
+  } else if (duration_s > MAG_STREAM_MAX_S) {
+    duration_s = MAG_STREAM_MAX_S;
+  }
+  stream_end_tick = xTaskGetTickCount() + pdMS_TO_TICKS(duration_s * 1000);
+  stream_active = true;
+}
+
+// Ends itself once the requested time is up, the publish task drains what is left
+static void stream_sample(QueueHandle_t mag_stream, const struct MagXYZ* mag) {
+  TickType_t now = xTaskGetTickCount();
+  if ((int32_t)(now - stream_end_tick) >= 0) {
+    stream_active = false;
+  } else {
+    struct MagSample sample = {
+        .tick_ms = now * portTICK_PERIOD_MS,
+        .x_uT = (float)mag->x_uT,
+        .y_uT = (float)mag->y_uT,
+        .z_uT = (float)mag->z_uT,
+    };
+    if (xQueueSend(mag_stream, &sample, 0) != pdTRUE) {
+      stream_drop_count++;
+    }
+  }
+}
+
 bool is_calibrated() { return (bool)calibration_offset_checked.rmse; }
 
 bool calibration_data_found() {
@@ -194,11 +232,19 @@ void vMagnetometerTask(void* pvParameters) {
 
   for (;;) {
     // Done first in the loop to prevent kasa algorithm from adding jitter
+    trace_begin(TRACE_MAG_READ, 0);
+    uint32_t read_start_us = time_us_32();
     struct MagXYZ mag = get_xyz_uT();
+    record_latency(LATENCY_MAG_READ, time_us_32() - read_start_us);
+    trace_end(TRACE_MAG_READ);
     if (xQueueOverwrite(mtp->mag_mailbox, &mag) != pdTRUE) {
       set_mailbox_error_count++;
     }
 
+    if (stream_active) {
+      stream_sample(mtp->mag_stream, &mag);
+    }
+
     if (uxSemaphoreGetCount(mtp->calibrate)) {
       run_calibration(x_vals_uT, y_vals_uT, &mag, mtp->calibrate);
     }
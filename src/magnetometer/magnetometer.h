@@ -5,6 +5,7 @@
 
 struct MagnetometerTaskParameters {
   QueueHandle_t mag_mailbox;
+  QueueHandle_t mag_stream;
   SemaphoreHandle_t calibrate;
 };
 
@@ -14,6 +15,14 @@ struct MagXYZ {
   double z_uT;
 };
 
+// One raw reading for the diagnostic stream
+struct MagSample {
+  uint32_t tick_ms;
+  float x_uT;
+  float y_uT;
+  float z_uT;
+};
+
 struct CircleCenter {
   double center_x;
   double center_y;
@@ -27,5 +36,9 @@ double get_heading(const struct MagXYZ *mag);
 void apply_calibration_kasa(struct MagXYZ *mag);
 void vMagnetometerTask(void *pvParameters);
 uint32_t get_mag_mailbox_set_error_count();
+// Queues every raw reading to the mag_stream queue for duration_s, 0 for the default
+void start_mag_stream(uint32_t duration_s);
+bool is_mag_stream_active();
+uint32_t get_mag_stream_drop_count();
 
 #endif
\ No newline at end of file
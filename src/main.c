@@ -9,16 +9,22 @@
 #include "blink.h"
 #include "commanding.h"
 #include "config.h"
+#include "connection.h"
 #include "dance_generator.h"
 #include "dance_time.h"
+#include "groups.h"
+#include "log.h"
 #include "hardware/watchdog.h"
+#include "incoming.h"
 #include "magnetometer.h"
 #include "motor.h"
 #include "mqtt.h"
 #include "picowota/reboot.h"
 #include "publish.h"
 #include "reboot.h"
+#include "stats.h"
 #include "task.h"
+#include "timers.h"
 #include "watchdog.h"
 #include "wifi.h"
 
@@ -81,30 +87,17 @@ static void vFreeRTOSInfoTask() {
   }
 }
 
-static void wifi_connect() {
-  printf("Connecting to Wi-Fi...\n");
-  if (PRINT_WIFI_CREDS) {
-    printf("WiFi SSID: %s\n", WIFI_SSID);
-    printf("WiFI Password: %s\n", WIFI_PASSWORD);
-  }
-
-  bool connected = false;
-
-  for (int i = 0; i < WIFI_CONNECT_RETRY_COUNT; i++) {
-    if (cyw43_arch_wifi_connect_timeout_ms(WIFI_SSID, WIFI_PASSWORD, CYW43_AUTH_WPA2_AES_PSK,
-                                           WIFI_TIMEOUT_MS)) {
-      printf("failed to connect to wifi.\n");
-      watchdog_update();
-    } else {
-      printf("Connected.\n");
-      connected = true;
-      break;
-    }
-  }
-  if (!connected) {
-    // Todo: consider return to dock
-    reboot(WIFI_CONNECT_REASON);
+// Creates a task and adds it to the run time stats, returns NULL on failure
+static TaskHandle_t create_task(TaskFunction_t task, const char *name, const char *stats_name,
+                                configSTACK_DEPTH_TYPE stack_depth, void *params,
+                                UBaseType_t priority) {
+  TaskHandle_t handle = NULL;
+  if (xTaskCreate(task, name, stack_depth, params, priority, &handle) != pdPASS) {
+    printf("%s Creation failed!\n", name);
+    handle = NULL;
   }
+  register_task_stats(handle, stats_name);
+  return handle;
 }
 
 // This task as early exits! Be careful with allocation.
@@ -127,13 +120,19 @@ static void vInitTask() {
   // Modes other than MQTT are for bringup and debug
   switch (WIFI_MODE) {
     case MQTT:
-      wifi_connect();
+      // Wi-Fi is brought up by the connection task, the duck can dance while offline
       break;
-    case PING:
-      wifi_connect();
+    case PING: {
+      // No MQTT client, only keeps Wi-Fi up
+      struct ConnectionTaskParameters *wifi_params =
+          (struct ConnectionTaskParameters *)pvPortMalloc(sizeof(struct ConnectionTaskParameters));
+      wifi_params->client = NULL;
+      wifi_params->mqtt_params = NULL;
+      xTaskCreate(vConnectionTask, "Connection Task", 1024, (void *)wifi_params, 2, NULL);
       xTaskCreate(vPing, "Ping Task", 2048, NULL, 3, NULL);
       vTaskDelete(NULL);  // Delete the current task ! EARLY EXIT !
       break;
+    }
     case SCAN:
       xTaskCreate(vScanWifi, "Scan Wifi Task", 2048, NULL, 2, NULL);
       vTaskDelete(NULL);  // Delete the current task ! EARLY EXIT !
@@ -153,10 +152,18 @@ static void vInitTask() {
            mac[4], mac[5]);
   printf("MAC: %s\n", global_mac_address);
 
+  // Group memberships are needed for the first MQTT subscriptions
+  groups_init();
+
   // FreeRTOS Shared Resources
-  QueueHandle_t motor_queue = xQueueCreate(MOTOR_QUEUE_DEPTH, sizeof(struct MotorCommand));
-  if (!motor_queue) {
-    printf("Motor Queue Creation failed!\n");
+  QueueHandle_t override_queue = xQueueCreate(MOTOR_QUEUE_DEPTH, sizeof(struct MotorCommand));
+  if (!override_queue) {
+    printf("Override Queue Creation failed!\n");
+  }
+
+  QueueHandle_t corrective_mailbox = xQueueCreate(1, sizeof(struct MotorCommand));
+  if (!corrective_mailbox) {
+    printf("Corrective Mailbox Creation failed!\n");
   }
 
   QueueHandle_t duck_mode_mailbox = xQueueCreate(1, sizeof(enum DuckMode));
@@ -169,6 +176,11 @@ static void vInitTask() {
     printf("Mag Mailbox Creation Failed!\n");
   }
 
+  QueueHandle_t mag_stream_queue = xQueueCreate(MAG_STREAM_DEPTH, sizeof(struct MagSample));
+  if (!mag_stream_queue) {
+    printf("Mag Stream Queue Creation Failed!\n");
+  }
+
   QueueHandle_t wind_mailbox = xQueueCreate(1, sizeof(struct WindCorrection));
   if (!wind_mailbox) {
     printf("Wind Mailbox Creation Failed!\n");
@@ -179,6 +191,16 @@ static void vInitTask() {
     printf("Motor Semaphore Creation failed!\n");
   }
 
+  MessageBufferHandle_t command_buffer = xMessageBufferCreate(COMMAND_BUFFER_SIZE);
+  if (!command_buffer) {
+    printf("Command Buffer Creation failed!\n");
+  }
+
+  QueueHandle_t ack_queue = xQueueCreate(ACK_QUEUE_DEPTH, sizeof(struct CommandAck));
+  if (!ack_queue) {
+    printf("Ack Queue Creation failed!\n");
+  }
+
   SemaphoreHandle_t calibration_semaphore = xSemaphoreCreateBinary();
   if (!calibration_semaphore) {
     printf("Calibration Semaphore Creation failed!\n");
@@ -195,47 +217,72 @@ static void vInitTask() {
   struct MagnetometerTaskParameters *mag_params =
       (struct MagnetometerTaskParameters *)pvPortMalloc(sizeof(struct MagnetometerTaskParameters));
   mag_params->mag_mailbox = mag_mailbox;
+  mag_params->mag_stream = mag_stream_queue;
   mag_params->calibrate = calibration_semaphore;
 
   struct MotorTaskParameters *motor_params =
       (struct MotorTaskParameters *)pvPortMalloc(sizeof(struct MotorTaskParameters));
-  motor_params->command_queue = motor_queue;
+  motor_params->override_queue = override_queue;
+  motor_params->corrective_mailbox = corrective_mailbox;
   motor_params->mag_queue = mag_mailbox;
   motor_params->motor_stop = motor_stop_semaphore;
+  motor_params->ack_queue = ack_queue;
 
   struct PublishTaskParameters *publish_params =
       (struct PublishTaskParameters *)pvPortMalloc(sizeof(struct PublishTaskParameters));
   publish_params->client = &static_client;
   publish_params->mag = mag_mailbox;
+  publish_params->mag_stream = mag_stream_queue;
   publish_params->duck_mode_mailbox = duck_mode_mailbox;
+  publish_params->ack_queue = ack_queue;
 
   struct MqttParameters *mqtt_params =
       (struct MqttParameters *)pvPortMalloc(sizeof(struct MqttParameters));
-  mqtt_params->motor_queue = motor_queue;
+  mqtt_params->override_queue = override_queue;
+  mqtt_params->corrective_mailbox = corrective_mailbox;
   mqtt_params->duck_mode_mailbox = duck_mode_mailbox;
   mqtt_params->wind_mailbox = wind_mailbox;
   mqtt_params->motor_stop = motor_stop_semaphore;
   mqtt_params->calibrate = calibration_semaphore;
+  mqtt_params->command_buffer = command_buffer;
+  mqtt_params->ack_queue = ack_queue;
+
+  struct ConnectionTaskParameters *connection_params =
+      (struct ConnectionTaskParameters *)pvPortMalloc(sizeof(struct ConnectionTaskParameters));
+  connection_params->client = &static_client;
+  connection_params->mqtt_params = mqtt_params;
+
+  struct LogTaskParameters *log_params =
+      (struct LogTaskParameters *)pvPortMalloc(sizeof(struct LogTaskParameters));
+  log_params->client = &static_client;
 
   struct DanceTimeParameters *dance_params =
       (struct DanceTimeParameters *)pvPortMalloc(sizeof(struct DanceTimeParameters));
-  dance_params->motor_queue = motor_queue;
+  dance_params->corrective_mailbox = corrective_mailbox;
   dance_params->duck_mode_mailbox = duck_mode_mailbox;
   dance_params->wind_mailbox = wind_mailbox;
 
   // FreeRTOS Task Creation - Lower number is lower priority!
-  xTaskCreate(vBlinkTask, "Blink Task", 512, NULL, 1, NULL);
-  xTaskCreate(vMagnetometerTask, "Mag Task", 2048, (void *)mag_params, 10, NULL);
-  xTaskCreate(vMotorTask, "Motor Task", 512, (void *)motor_params, 11, NULL);
-  xTaskCreate(vDanceTimeTask, "Dance Task", 512, (void *)dance_params, 12, NULL);
-  if (mqtt_connect(&static_client, (void *)mqtt_params) == ERR_OK) {
-    xTaskCreate(vPublishTask, "MQTT Pub Task", 1024, (void *)publish_params, 3, NULL);
-  }
+  create_task(vBlinkTask, "Blink Task", "blink", 512, NULL, 1);
+  create_task(vMagnetometerTask, "Mag Task", "mag", 2048, (void *)mag_params, 10);
+  create_task(vMotorTask, "Motor Task", "motor", 512, (void *)motor_params, 11);
+  create_task(vDanceTimeTask, "Dance Task", "dance", 512, (void *)dance_params, 12);
+  create_task(vCommandTask, "Command Task", "command", 1024, (void *)mqtt_params, 4);
+  create_task(vConnectionTask, "Connection Task", "connection", 1024, (void *)connection_params,
+              2);
+  create_task(vPublishTask, "MQTT Pub Task", "publish", 1024, (void *)publish_params, 3);
+  create_task(vLogTask, "Log Task", "log", 512, (void *)log_params, 1);
   if (FREERTOS_PRINT_INFO_DEBUG) {
     xTaskCreate(vFreeRTOSInfoTask, "Print Status Task", 512, NULL, 2, NULL);
   }
-  TaskHandle_t xHandle;
-  xTaskCreate(vWatchDogTask, "Watchdog Task", 128, NULL, 1, &(xHandle));
+  TaskHandle_t xHandle = create_task(vWatchDogTask, "Watchdog Task", "watchdog", 128, NULL, 1);
+  // Created by the scheduler, registered so they are named in traces
+  register_task_stats(xTimerGetTimerDaemonTaskHandle(), "timer");
+  register_task_stats(xTaskGetIdleTaskHandleForCore(0), "idle0");
+  register_task_stats(xTaskGetIdleTaskHandleForCore(1), "idle1");
+  // SMP idle tasks can run on either core, pinned so idle time is per core load
+  vTaskCoreAffinitySet(xTaskGetIdleTaskHandleForCore(0), 0x01);
+  vTaskCoreAffinitySet(xTaskGetIdleTaskHandleForCore(1), 0x02);
   if (DEBUG_IDLE) {
     // Toggle for CPU utilization on Logic Analyzer
     vTaskCoreAffinitySet(xHandle, 0x01);
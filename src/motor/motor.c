@@ -7,13 +7,17 @@
 
 #include "commanding.h"
 #include "config.h"
+#include "dance_generator.h"
 #include "hardware/pwm.h"
+#include "latency.h"
+#include "log.h"
 #include "magnetometer.h"
 #include "math.h"
 #include "motor.h"
 #include "stdio.h"
 #include "string.h"
 #include "task.h"
+#include "trace.h"
 
 static const bool DEBUG_PRINT = false;
 static const uint32_t LOOP_DELAY_MS = 100;
@@ -40,6 +44,12 @@ static const double COUNTER_CLK_DIV = 4.0;
 
 static uint32_t motor_cmd_rx_count = 0;
 static uint32_t motor_drv_error_count = 0;
+static uint32_t lane_latency_max_us[NUM_MOTOR_LANES] = {0};
+static volatile uint32_t stop_received_us = 0;
+static volatile bool emergency_stop_latched = false;
+static uint32_t emergency_stop_count = 0;
+static uint32_t emergency_stop_cb_to_pwm_us = 0;
+static TaskHandle_t motor_task_handle = NULL;
 
 static void init_motor() {
   gpio_set_function(MOTOR_A_RIGHT_FORWARD_PWM_GPIO, GPIO_FUNC_PWM);
@@ -83,13 +93,31 @@ static int16_t bi_unit_clamp_and_expand(double val) {
   return (int16_t)(ret_val * (double)COUNTER_WRAP_COUNT);
 }
 
+// Serialised with emergency_stop_motors() so a stop can never be overwritten by a stale command
+static void write_motor_outputs(uint16_t right_a, uint16_t right_b, uint16_t left_a,
+                                uint16_t left_b, bool motor_driver_sleep) {
+  uint slice_num_a_right = pwm_gpio_to_slice_num(MOTOR_A_RIGHT_FORWARD_PWM_GPIO);
+  uint slice_num_b_left = pwm_gpio_to_slice_num(MOTOR_B_LEFT_FORWARD_PWM_GPIO);
+
+  taskENTER_CRITICAL();
+  if (!emergency_stop_latched) {
+    pwm_set_chan_level(slice_num_a_right, PWM_CHAN_A, right_a);
+    pwm_set_chan_level(slice_num_a_right, PWM_CHAN_B, right_b);
+    pwm_set_chan_level(slice_num_b_left, PWM_CHAN_A, left_a);
+    pwm_set_chan_level(slice_num_b_left, PWM_CHAN_B, left_b);
+    gpio_put(MOTOR_N_SLEEP_GPIO, motor_driver_sleep ? 0 : 1);
+  }
+  taskEXIT_CRITICAL();
+}
+
 static void set_motor(struct MotorCommand *mc) {
   int16_t motor_right_duty = bi_unit_clamp_and_expand(mc->motor_right_duty_cycle);
   int16_t motor_left_duty = bi_unit_clamp_and_expand(mc->motor_left_duty_cycle);
 
-  uint slice_num_a_right = pwm_gpio_to_slice_num(MOTOR_A_RIGHT_FORWARD_PWM_GPIO);
-  uint slice_num_b_left = pwm_gpio_to_slice_num(MOTOR_B_LEFT_FORWARD_PWM_GPIO);
-
+  uint16_t right_a = 0;
+  uint16_t right_b = 0;
+  uint16_t left_a = 0;
+  uint16_t left_b = 0;
   bool motor_driver_sleep = true;
 
   // Motor 1
@@ -97,22 +125,18 @@ static void set_motor(struct MotorCommand *mc) {
     motor_right_duty = -motor_right_duty;
   }
   if (motor_right_duty > 0) {
-    pwm_set_chan_level(slice_num_a_right, PWM_CHAN_A, (uint16_t)motor_right_duty);
-    pwm_set_chan_level(slice_num_a_right, PWM_CHAN_B, 0);
+    right_a = (uint16_t)motor_right_duty;
   } else {
-    pwm_set_chan_level(slice_num_a_right, PWM_CHAN_A, 0);
-    pwm_set_chan_level(slice_num_a_right, PWM_CHAN_B, (uint16_t)-motor_right_duty);
+    right_b = (uint16_t)-motor_right_duty;
   }
   // Motor 2
   if (MIRRORED_PROPS && LEFT_INVERTED) {
     motor_left_duty = -motor_left_duty;
   }
   if (motor_left_duty > 0) {
-    pwm_set_chan_level(slice_num_b_left, PWM_CHAN_A, (uint16_t)motor_left_duty);
-    pwm_set_chan_level(slice_num_b_left, PWM_CHAN_B, 0);
+    left_a = (uint16_t)motor_left_duty;
   } else {
-    pwm_set_chan_level(slice_num_b_left, PWM_CHAN_A, 0);
-    pwm_set_chan_level(slice_num_b_left, PWM_CHAN_B, (uint16_t)-motor_left_duty);
+    left_b = (uint16_t)-motor_left_duty;
   }
   // Motor Sleep
   if (motor_right_duty || motor_left_duty) {
@@ -123,7 +147,7 @@ static void set_motor(struct MotorCommand *mc) {
     printf("Right Duty: %" PRIi16 ", Left Duty: %" PRIi16 "\n", motor_right_duty, motor_left_duty);
   }
 
-  gpio_put(MOTOR_N_SLEEP_GPIO, motor_driver_sleep ? 0 : 1);
+  write_motor_outputs(right_a, right_b, left_a, left_b, motor_driver_sleep);
 }
 
 static void point(struct MotorCommand *mc, double error) {
@@ -143,11 +167,15 @@ static void point(struct MotorCommand *mc, double error) {
   }
 }
 
-static void swim(struct MotorCommand *mc, double error) {
-  // PD Controls
-  double derivative = error - mc->previous_error;
+// elapsed_ms is the time since the last loop, which new commands can wake early
+static void swim(struct MotorCommand *mc, double error, uint32_t elapsed_ms) {
+  // PD Controls, the derivative is per LOOP_DELAY_MS so Kd is tuned for the timed loop
+  double derivative = 0.0;
+  if (elapsed_ms > 0) {
+    derivative = (error - mc->previous_error) * (double)LOOP_DELAY_MS / (double)elapsed_ms;
+    mc->previous_error = error;
+  }
   double adjustment = mc->Kp * error + mc->Kd * derivative;
-  mc->previous_error = error;
 
   if (DEBUG_PRINT) {
     printf("error: %f adjustment: %f\n", error, adjustment);
@@ -187,7 +215,8 @@ static double get_heading_offset(QueueHandle_t mailbox, double desired_heading)
   return angle_diff;
 }
 
-static void execute_motor_algorithm(struct MotorCommand *mc, struct MotorTaskParameters *mtp) {
+static void execute_motor_algorithm(struct MotorCommand *mc, struct MotorTaskParameters *mtp,
+                                    uint32_t elapsed_ms) {
   double heading_offset = get_heading_offset(mtp->mag_queue, mc->desired_heading);
 
   // Perform motor algorithm
@@ -200,7 +229,7 @@ static void execute_motor_algorithm(struct MotorCommand *mc, struct MotorTaskPar
         point(mc, heading_offset);
         break;
       case SWIM:
-        swim(mc, heading_offset);
+        swim(mc, heading_offset, elapsed_ms);
         break;
       case FLOAT:
         // No manipulation needed
@@ -211,35 +240,141 @@ static void execute_motor_algorithm(struct MotorCommand *mc, struct MotorTaskPar
   }
 }
 
-static void check_motor_stop(struct MotorCommand *mc, SemaphoreHandle_t motor_stop) {
+static bool check_motor_stop(struct MotorCommand *mc, SemaphoreHandle_t motor_stop) {
   if (uxSemaphoreGetCount(motor_stop)) {
     // Reset motor command
     memset(mc, 0, sizeof(struct MotorCommand));
-    printf("Motor Stopped!\n");
+    mc->received_us = stop_received_us;
+    // Stop has reached the motor task, normal PWM updates can resume
+    emergency_stop_latched = false;
+    log_event(LOG_MOTOR_STOPPED, 0, 0, 0);
     // Drop Semaphore to 0
     if (xSemaphoreTake(motor_stop, 0) == pdFALSE) {
-      printf("Error: Motor Stop Semaphore");
+      log_event(LOG_MOTOR_STOP_TAKE_ERROR, 0, 0, 0);
     }
+    return true;
   }
+  return false;
+}
+
+static void log_loaded_command(enum LogFormat id, const struct MotorCommand *mc) {
+  log_event(id, (uint32_t)mc->type, mc->remaining_time_ms, 0);
 }
 
-static void load_motor_command(struct MotorCommand *mc, struct MotorTaskParameters *mtp) {
-  if (xQueueReceive(mtp->command_queue, mc, 0)) {
+// Load from the highest priority lane with work, pre-empting any active command below it
+// Returns true if a new command was loaded
+static bool select_motor_command(struct MotorCommand *mc, enum MotorLane *lane,
+                                 uint32_t *dance_generation, struct MotorTaskParameters *mtp) {
+  bool active = (mc->remaining_time_ms != 0);
+
+  if (check_motor_stop(mc, mtp->motor_stop)) {
+    *lane = STOP_LANE;
+    return true;
+  }
+
+  // A new or stopped dance ends the dance move in progress
+  if (active && (*lane == CHOREOGRAPHY_LANE) &&
+      (*dance_generation != get_dance_sequencer_generation())) {
+    active = false;
+  }
+
+  if ((!active || (*lane > OVERRIDE_LANE)) && xQueueReceive(mtp->override_queue, mc, 0)) {
+    *lane = OVERRIDE_LANE;
     motor_cmd_rx_count++;
-    if (DEBUG_PRINT) {
-      printf("Motor msg rx: %" PRIu32 "ms\n", mc->remaining_time_ms);
+    log_loaded_command(LOG_OVERRIDE_LOADED, mc);
+    return true;
+  }
+
+  if ((!active || (*lane > CORRECTIVE_LANE)) && xQueueReceive(mtp->corrective_mailbox, mc, 0)) {
+    *lane = CORRECTIVE_LANE;
+    log_loaded_command(LOG_CORRECTIVE_LOADED, mc);
+    return true;
+  }
+
+  if (!active) {
+    if (next_dance_move(mc, dance_generation)) {
+      *lane = CHOREOGRAPHY_LANE;
+      log_loaded_command(LOG_DANCE_LOADED, mc);
+      return true;
     }
-    printf("Motor Command Type: %" PRIu32 "\n", (uint32_t)mc->type);
-    printf("Motor Command Duration: %" PRIu32 "\n", mc->remaining_time_ms);
-  } else {
     memset(mc, 0, sizeof(struct MotorCommand));
   }
+
+  return false;
+}
+
+// Choreography and wind corrections stamp received_us when generated, only the stop and override
+// lanes carry an MQTT receive time
+static void record_lane_latency(enum MotorLane lane, uint32_t received_us) {
+  uint32_t latency_us = time_us_32() - received_us;
+  if (lane == STOP_LANE || lane == OVERRIDE_LANE) {
+    record_latency(LATENCY_COMMAND_TO_MOTOR, latency_us);
+  }
+  taskENTER_CRITICAL();
+  if (latency_us > lane_latency_max_us[lane]) {
+    lane_latency_max_us[lane] = latency_us;
+  }
+  taskEXIT_CRITICAL();
+}
+
+// Tells the sender a sequenced override command is now driving the motors
+static void send_executed_event(const struct MotorCommand *mc, QueueHandle_t ack_queue) {
+  struct CommandAck event = {EXECUTED_EVENT, ACK_ACCEPTED, mc->src, 1, mc->seq};
+  if (xQueueSendToBack(ack_queue, &event, 0) != pdTRUE) {
+    log_event(LOG_ACK_QUEUE_FULL, 0, 0, 0);
+  }
 }
 
 uint32_t get_motor_command_rx_count() { return motor_cmd_rx_count; }
 
 uint32_t get_motor_drv_error_count() { return motor_drv_error_count; }
 
+// Read and reset by the publish task on the other core, a max set in between would be lost
+uint32_t get_motor_lane_latency_max_us(enum MotorLane lane) {
+  taskENTER_CRITICAL();
+  uint32_t latency_us = lane_latency_max_us[lane];
+  lane_latency_max_us[lane] = 0;
+  taskEXIT_CRITICAL();
+  return latency_us;
+}
+
+uint32_t get_emergency_stop_count() { return emergency_stop_count; }
+
+uint32_t get_emergency_stop_cb_to_pwm_us() { return emergency_stop_cb_to_pwm_us; }
+
+void emergency_stop_motors(uint32_t received_us) {
+  uint slice_num_a_right = pwm_gpio_to_slice_num(MOTOR_A_RIGHT_FORWARD_PWM_GPIO);
+  uint slice_num_b_left = pwm_gpio_to_slice_num(MOTOR_B_LEFT_FORWARD_PWM_GPIO);
+
+  taskENTER_CRITICAL();
+  emergency_stop_latched = true;
+  pwm_set_chan_level(slice_num_a_right, PWM_CHAN_A, 0);
+  pwm_set_chan_level(slice_num_a_right, PWM_CHAN_B, 0);
+  pwm_set_chan_level(slice_num_b_left, PWM_CHAN_A, 0);
+  pwm_set_chan_level(slice_num_b_left, PWM_CHAN_B, 0);
+  gpio_put(MOTOR_N_SLEEP_GPIO, 0);
+  taskEXIT_CRITICAL();
+
+  emergency_stop_cb_to_pwm_us = time_us_32() - received_us;
+  emergency_stop_count++;
+}
+
+void request_motor_stop(SemaphoreHandle_t motor_stop, uint32_t received_us) {
+  stop_received_us = received_us;
+  // Only fails when a stop is already pending, the stop_all callback and its queued command both
+  // request one
+  if (xSemaphoreGive(motor_stop) == pdFALSE) {
+    log_event(LOG_MOTOR_STOP_PENDING, 0, 0, 0);
+  }
+  wake_motor_task();
+}
+
+void wake_motor_task() {
+  if (motor_task_handle) {
+    xTaskNotifyGive(motor_task_handle);
+  }
+}
+
 // Motor Notes:
 // >70% duty cycle to turn on
 // Turns off <65% or so
@@ -249,37 +384,64 @@ void vMotorTask(void *pvParameters) {
 
   struct MotorTaskParameters *mtp = (struct MotorTaskParameters *)pvParameters;
   struct MotorCommand mc = {0};
+  enum MotorLane lane = CHOREOGRAPHY_LANE;
+  uint32_t dance_generation = 0;
+  uint8_t executed_src = 0;  // Last sequenced command reported as executed
+  uint32_t executed_seq = 0;
 
   vTaskDelay(1000);
 
-  for (;;) {
-    // Check semaphore for halt command
-    check_motor_stop(&mc, mtp->motor_stop);
+  motor_task_handle = xTaskGetCurrentTaskHandle();
+  TickType_t last_tick = xTaskGetTickCount();
+  uint32_t loop_start_us = time_us_32();
+  bool timed_wake = false;
 
-    // Load motor command if previous mc expired
-    if (mc.remaining_time_ms == 0) {
-      load_motor_command(&mc, mtp);
+  for (;;) {
+    trace_begin(TRACE_MOTOR_LOOP, 0);
+    uint32_t start_us = time_us_32();
+    // Early wakes from new commands are not the loop period, they would hide its jitter
+    if (timed_wake) {
+      record_latency(LATENCY_MOTOR_LOOP_PERIOD, start_us - loop_start_us);
+    }
+    loop_start_us = start_us;
+
+    // Count down by the time actually elapsed, the loop can be woken early by new commands
+    TickType_t now = xTaskGetTickCount();
+    uint32_t elapsed_ms = (now - last_tick) * portTICK_PERIOD_MS;
+    last_tick = now;
+    if (mc.remaining_time_ms > elapsed_ms) {
+      mc.remaining_time_ms -= elapsed_ms;
+    } else {
+      mc.remaining_time_ms = 0;
     }
 
+    bool loaded = select_motor_command(&mc, &lane, &dance_generation, mtp);
+
     // Update motor command based on algorithm choice
-    execute_motor_algorithm(&mc, mtp);
+    execute_motor_algorithm(&mc, mtp, elapsed_ms);
 
     // Update PWM and Sleep Pin
     set_motor(&mc);
 
+    if (loaded) {
+      record_lane_latency(lane, mc.received_us);
+      // A sequence's moves share its src and seq, reported when the first of them starts
+      bool new_id = (mc.src != executed_src) || (mc.seq != executed_seq);
+      if ((lane == OVERRIDE_LANE) && mc.seq && new_id) {
+        send_executed_event(&mc, mtp->ack_queue);
+        executed_src = mc.src;
+        executed_seq = mc.seq;
+      }
+    }
+
     // Check Fault Pin
     if (gpio_get(MOTOR_FAULT_GPIO)) {
-      printf("DRV Fault!\n");
+      log_event(LOG_DRV_FAULT, 0, 0, 0);
       motor_drv_error_count++;
     }
 
-    // Check remaining time
-    if (mc.remaining_time_ms > LOOP_DELAY_MS) {
-      mc.remaining_time_ms -= LOOP_DELAY_MS;
-    } else {
-      mc.remaining_time_ms = 0;
-    }
-
-    vTaskDelay(LOOP_DELAY_MS);
+    trace_end(TRACE_MOTOR_LOOP);
+    // Sleep until the next loop, or until a new command arrives
+    timed_wake = (ulTaskNotifyTake(pdTRUE, LOOP_DELAY_MS) == 0);
   }
 }
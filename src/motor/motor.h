@@ -4,15 +4,37 @@
 #include "queue.h"
 #include "semphr.h"
 
+// Command lanes in priority order, a lane pre-empts any active command in a lane below it
+enum MotorLane {
+  STOP_LANE = 0,
+  OVERRIDE_LANE = 1,
+  CORRECTIVE_LANE = 2,
+  CHOREOGRAPHY_LANE = 3,
+  NUM_MOTOR_LANES = 4,
+};
+
 struct MotorTaskParameters {
-  QueueHandle_t command_queue;
+  QueueHandle_t override_queue;
+  QueueHandle_t corrective_mailbox;
   QueueHandle_t mag_queue;
   SemaphoreHandle_t motor_stop;
   SemaphoreHandle_t calibrate;
+  QueueHandle_t ack_queue;
 };
 
 uint32_t get_motor_command_rx_count();
 uint32_t get_motor_drv_error_count();
+// Worst latency from command receipt to PWM change since the last read
+uint32_t get_motor_lane_latency_max_us(enum MotorLane lane);
+uint32_t get_emergency_stop_count();
+// From the MQTT publish callback to the PWM cut, network and broker time are not included
+uint32_t get_emergency_stop_cb_to_pwm_us();
+// Cut PWM and sleep the motor driver immediately, safe to call from any task
+// Outputs stay off until the motor task has processed a request_motor_stop()
+void emergency_stop_motors(uint32_t received_us);
+void request_motor_stop(SemaphoreHandle_t motor_stop, uint32_t received_us);
+// Wake the motor task early so a new command is picked up without waiting for the next loop
+void wake_motor_task();
 void vMotorTask(void *pvParameters);
 
-#endif
\ No newline at end of file
+#endif
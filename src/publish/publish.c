@@ -9,50 +9,45 @@
 #include "pico/unique_id.h"
 
 #include "lwip/apps/mqtt.h"
-#include "lwip/apps/mqtt_priv.h"
 
 #include "adc.h"
+#include "choreography.h"
 #include "commanding.h"
 #include "config.h"
+#include "connection.h"
 #include "dance_generator.h"
 #include "dance_time.h"
+#include "dedupe.h"
+#include "groups.h"
+#include "incoming.h"
+#include "latency.h"
 #include "lis2mdl.h"
+#include "log.h"
 #include "magnetometer.h"
 #include "motor.h"
 #include "mqtt.h"
 #include "publish.h"
 #include "reboot.h"
+#include "stats.h"
 #include "task.h"
-
-static const uint32_t CONTINUOUS_PUBLISH_ERROR_RESET_COUNT = 5000;
-static const uint32_t CONTINUOUS_CALLBACK_ERROR_RESET_COUNT = 250;
+#include "telemetry.h"
+#include "trace.h"
 
 static uint32_t callback_error_count = 0;
-static uint32_t continuous_callback_error_count = 0;
 static uint32_t publish_error_count = 0;
-static uint32_t continuous_publish_error_count = 0;
-
-static void check_continuous_error_count() {
-  if ((continuous_publish_error_count > CONTINUOUS_PUBLISH_ERROR_RESET_COUNT) ||
-      (continuous_callback_error_count > CONTINUOUS_CALLBACK_ERROR_RESET_COUNT)) {
-    reboot(MQTT_PUBLISH_TIMEOUT_REASON);
-  }
-}
 
 /* Callback for publish request */
 static void mqtt_pub_request_cb(void *arg, err_t result) {
   (void)arg;
 
   if (result != ERR_OK) {
-    printf("Publish result: %d\n", result);
+    log_event(LOG_PUBLISH_RESULT, (uint32_t)result, 0, 0);
     callback_error_count++;
-    continuous_callback_error_count++;
-  } else {
-    continuous_callback_error_count = 0;
   }
 }
 
-static void publish(mqtt_client_t *client, const char *topic, const char *payload) {
+bool publish_payload(mqtt_client_t *client, const char *topic, const void *payload, size_t len,
+                     uint8_t qos) {
   char topic_buffer[128];
   snprintf(topic_buffer, sizeof(topic_buffer), "%s/devices/%" PRIu32 "/%s",
            DANCING_DUCK_SUBSCRIPTION, (uint32_t)DUCK_ID_NUM, topic);
@@ -60,28 +55,22 @@ static void publish(mqtt_client_t *client, const char *topic, const char *payloa
   // Acquire locks
   cyw43_arch_lwip_begin();
   err_t err =
-      mqtt_publish(client, topic_buffer, payload, strlen(payload), 1, 0, mqtt_pub_request_cb, NULL);
+      mqtt_publish(client, topic_buffer, payload, (u16_t)len, qos, 0, mqtt_pub_request_cb, NULL);
   cyw43_arch_lwip_end();
 
   if (err != ERR_OK) {
     printf("Publish err: %d\n", err);
     publish_error_count++;
-    continuous_publish_error_count++;
-  } else {
-    continuous_publish_error_count = 0;
   }
+  return err == ERR_OK;
 }
 
-static void publish_float(mqtt_client_t *client, const char *topic, double val) {
-  char payload[64] = {0};
-  snprintf(payload, sizeof(payload), "%.4f", val);
-  publish(client, topic, payload);
+static void publish(mqtt_client_t *client, const char *topic, const char *payload) {
+  publish_payload(client, topic, payload, strlen(payload), 1);
 }
 
-static void publish_int(mqtt_client_t *client, const char *topic, int32_t val) {
-  char payload[64] = {0};
-  snprintf(payload, sizeof(payload), "%" PRIi32 "", val);
-  publish(client, topic, payload);
+void publish_log(mqtt_client_t *client, const char *text, size_t len) {
+  publish_payload(client, "log", text, len, 0);
 }
 
 extern char global_mac_address[32];
@@ -96,42 +85,268 @@ static void publish_mac(mqtt_client_t *client) {
   publish(client, mac_topic, mac_payload);
 }
 
-static void publish_rssi(mqtt_client_t *client) {
-  int32_t rssi;
-  if (cyw43_wifi_get_rssi(&cyw43_state, &rssi) == PICO_OK) {
-    publish_int(client, "metric/rssi", rssi);
+// Sent once each time the link returns after an outage
+static void publish_offline_time(mqtt_client_t *client) {
+  uint32_t offline_ms;
+  if (get_offline_report(&offline_ms)) {
+    publish_metric(client, TM_OFFLINE_MS, offline_ms);
   }
 }
 
 static void publish_duck_mode(struct PublishTaskParameters *params) {
   enum DuckMode dm = {0};
   xQueuePeek(params->duck_mode_mailbox, &dm, 0);
-  publish_int(params->client, "metric/duck_mode", dm);
+  publish_metric(params->client, TM_DUCK_MODE, dm);
 }
 
-static void publish_magnetometer_metrics(struct PublishTaskParameters *params) {
-  struct MagXYZ mag_xyz = {0};
-  xQueuePeek(params->mag, &mag_xyz, 0);
+static void sample_fast_telemetry(struct PublishTaskParameters *params, struct FastTelemetry *ft) {
+  memset(ft, 0, sizeof(struct FastTelemetry));
 
-  publish_float(params->client, "sensor/mag_x_uT", mag_xyz.x_uT);
-  publish_float(params->client, "sensor/mag_y_uT", mag_xyz.y_uT);
-  publish_float(params->client, "sensor/mag_z_uT", mag_xyz.z_uT);
-
-  apply_calibration_kasa(&mag_xyz);
-
-  publish_float(params->client, "sensor/mag_calibrated_x_uT", mag_xyz.x_uT);
-  publish_float(params->client, "sensor/mag_calibrated_y_uT", mag_xyz.y_uT);
-  publish_float(params->client, "sensor/heading", get_heading(&mag_xyz));
+  xQueuePeek(params->mag, &ft->raw, 0);
+  ft->calibrated = ft->raw;
+  apply_calibration_kasa(&ft->calibrated);
+  ft->heading = get_heading(&ft->calibrated);
 
   struct CircleCenter cr;
   get_kasa_raw(&cr);
-  publish_float(params->client, "metric/kasa_rmse", cr.rmse);
+  ft->kasa_rmse = cr.rmse;
+
+  ft->rssi_valid = (cyw43_wifi_get_rssi(&cyw43_state, &ft->rssi) == PICO_OK);
+  ft->publish_error_count = publish_error_count;
+  ft->current_dance = get_current_dance();
+  ft->estop_count = get_emergency_stop_count();
+  ft->estop_cb_to_pwm_us = get_emergency_stop_cb_to_pwm_us();
+}
+
+// This function has early exits
+static void publish_fast_telemetry(struct PublishTaskParameters *params) {
+  struct FastTelemetry ft;
+  sample_fast_telemetry(params, &ft);
+  update_shed_level(params->client, &ft);
+
+  static uint32_t fast_count = 0;
+  if ((fast_count++ % get_fast_telemetry_period_s()) != 0) {
+    return;  // Early Exit!
+  }
+
+  publish_fast_telemetry_record(params->client, &ft);
+}
+
+/*
+ * Magnetometer stream chunk, version 1, little endian
+ *
+ * uint8_t version
+ * uint8_t duck_id
+ * uint8_t count      Samples in this chunk, up to MAG_STREAM_CHUNK_SAMPLES
+ * uint8_t flags      MAG_STREAM_LAST on the final chunk of a stream
+ * count times
+ *   uint32_t tick_ms
+ *   float x_uT
+ *   float y_uT
+ *   float z_uT
+ *
+ * Decoded by python/mag_calibrate.py
+ */
+enum { MAG_STREAM_VERSION = 1, MAG_STREAM_LAST = 0x01 };
+enum { MAG_STREAM_HEADER_SIZE = 4, MAG_STREAM_SAMPLE_SIZE = 16 };
+
+enum {
+  MAG_STREAM_CHUNK_SIZE = MAG_STREAM_HEADER_SIZE + MAG_STREAM_CHUNK_SAMPLES * MAG_STREAM_SAMPLE_SIZE
+};
+
+// Returns the chunk size
+static size_t build_mag_stream_chunk(QueueHandle_t mag_stream, bool active, uint8_t *chunk) {
+  uint8_t *out = &chunk[MAG_STREAM_HEADER_SIZE];
+  uint8_t count = 0;
+  struct MagSample sample;
+  while ((count < MAG_STREAM_CHUNK_SAMPLES) && (xQueueReceive(mag_stream, &sample, 0) == pdTRUE)) {
+    out = put_u32_le(out, sample.tick_ms);
+    out = put_float_le(out, sample.x_uT);
+    out = put_float_le(out, sample.y_uT);
+    out = put_float_le(out, sample.z_uT);
+    count++;
+  }
+
+  bool last = !active && (uxQueueMessagesWaiting(mag_stream) == 0);
+  chunk[0] = MAG_STREAM_VERSION;
+  chunk[1] = (uint8_t)DUCK_ID_NUM;
+  chunk[2] = count;
+  chunk[3] = last ? MAG_STREAM_LAST : 0;
+  return (size_t)(out - chunk);
+}
+
+// Full chunks while streaming, then whatever is left once the stream has ended
+// A chunk lwIP does not take is kept and sent again next slot, the mag task counts samples that
+// overflow the queue meanwhile
+// This function has early exits
+static void publish_mag_stream(struct PublishTaskParameters *params) {
+  static bool stream_open = false;
+  static uint8_t chunk[MAG_STREAM_CHUNK_SIZE];
+  static size_t chunk_size = 0;
+  bool active = is_mag_stream_active();
+  UBaseType_t waiting = uxQueueMessagesWaiting(params->mag_stream);
+  stream_open = stream_open || active;
+
+  if (get_shed_level() == SHED_MINIMAL) {
+    return;  // Early Exit!
+  }
+
+  if (chunk_size == 0) {
+    if (!stream_open || (active && (waiting < MAG_STREAM_CHUNK_SAMPLES))) {
+      return;  // Early Exit!
+    }
+    chunk_size = build_mag_stream_chunk(params->mag_stream, active, chunk);
+  }
+
+  if (!publish_payload(params->client, "sensor/mag/stream", chunk, chunk_size, 1)) {
+    return;  // Early Exit!
+  }
+
+  chunk_size = 0;
+  if (chunk[3] & MAG_STREAM_LAST) {
+    stream_open = false;
+  }
+}
+
+// Task names first, so the converter can label the switch records, then one chunk per slot
+// This function has early exits
+static void publish_trace_dump(mqtt_client_t *client) {
+  static bool names_sent = false;
+  if (get_trace_dump_owner() != TRACE_DUMP_MQTT) {
+    names_sent = false;
+    return;  // Early Exit!
+  }
+
+  // Anything lwIP does not take is sent again next slot
+  if (!names_sent) {
+    char names[512];
+    size_t len = format_trace_task_names(names, sizeof(names));
+    names_sent = publish_payload(client, "trace/tasks", names, len, 1);
+    return;  // Early Exit!
+  }
+
+  static uint8_t chunk[TRACE_CHUNK_MAX_SIZE];
+  size_t len = read_trace_chunk(chunk);
+  if (publish_payload(client, "trace", chunk, len, 1)) {
+    commit_trace_chunk();
+  }
+}
+
+// Per task lines are tagged with the task, they are dropped first when the link is congested
+// This function has early exits
+static void publish_runtime_stats(mqtt_client_t *client) {
+  static struct RuntimeStats rs;
+  sample_runtime_stats(&rs);
+
+  publish_metric(client, TM_CORE0_LOAD_PCT, rs.core_load_pct[0]);
+  publish_metric(client, TM_CORE1_LOAD_PCT, rs.core_load_pct[1]);
+  publish_metric(client, TM_HEAP_MIN_FREE_BYTES, rs.min_free_heap_bytes);
+
+  if (shed_extra_lines(rs.task_count * 2)) {
+    return;  // Early Exit!
+  }
+
+  for (size_t i = 0; i < rs.task_count; i++) {
+    char tags[32];
+    char value[16];
+    snprintf(tags, sizeof(tags), ",task=%s", rs.tasks[i].name);
+    snprintf(value, sizeof(value), "%.1f", rs.tasks[i].cpu_pct);
+    frame_add(client, "metric/task_cpu_pct", tags, value, 0);
+    snprintf(value, sizeof(value), "%" PRIu32 "", rs.tasks[i].stack_free_bytes);
+    frame_add(client, "metric/task_stack_free_bytes", tags, value, 0);
+  }
+}
+
+static void publish_lane_latency(mqtt_client_t *client) {
+  publish_metric(client, TM_STOP_LANE_LATENCY_MAX_US, get_motor_lane_latency_max_us(STOP_LANE));
+  publish_metric(client, TM_OVERRIDE_LANE_LATENCY_MAX_US,
+                 get_motor_lane_latency_max_us(OVERRIDE_LANE));
+  publish_metric(client, TM_CORRECTIVE_LANE_LATENCY_MAX_US,
+                 get_motor_lane_latency_max_us(CORRECTIVE_LANE));
+  publish_metric(client, TM_DANCE_LANE_LATENCY_MAX_US,
+                 get_motor_lane_latency_max_us(CHOREOGRAPHY_LANE));
+}
+
+/*
+ * One line per path with every field, read every 10 s, for example
+ *   latency_us,measurement_type=metric,path=mag_read count=100,p50=1279,p99=1535,max=1410
+ * The histograms are read even when the lines are shed, so each line covers one period.
+ */
+// This function has early exits
+static void publish_latency_summaries(mqtt_client_t *client) {
+  static const char *LATENCY_PATH_TAGS[NUM_LATENCY_PATHS] = {
+      [LATENCY_MOTOR_LOOP_PERIOD] = ",path=motor_loop_period",
+      [LATENCY_MAG_READ] = ",path=mag_read",
+      [LATENCY_MQTT_DATA_CB] = ",path=mqtt_data_cb",
+      [LATENCY_COMMAND_TO_MOTOR] = ",path=command_to_motor",
+  };
+
+  struct LatencySummary summaries[NUM_LATENCY_PATHS];
+  for (size_t path = 0; path < NUM_LATENCY_PATHS; path++) {
+    read_latency_summary((enum LatencyPath)path, &summaries[path]);
+  }
+
+  if (shed_extra_lines(NUM_LATENCY_PATHS)) {
+    return;  // Early Exit!
+  }
+
+  for (size_t path = 0; path < NUM_LATENCY_PATHS; path++) {
+    const struct LatencySummary *s = &summaries[path];
+    if (s->count == 0) {
+      continue;
+    }
+    char fields[80];
+    snprintf(fields, sizeof(fields),
+             "count=%" PRIu32 ",p50=%" PRIu32 ",p99=%" PRIu32 ",max=%" PRIu32 "", s->count,
+             s->p50_us, s->p99_us, s->max_us);
+    frame_add_fields(client, "metric/latency_us", LATENCY_PATH_TAGS[path], fields, 0);
+  }
+}
+
+static void publish_acks(struct PublishTaskParameters *params) {
+  static const char *ACK_TOPICS[] = {
+      [SEQUENCE_ACK] = "ack/sequence",
+      [GROUPS_ACK] = "ack/groups",
+      [MOTOR_ACK] = "ack/motor",
+      [LAUNCH_ACK] = "ack/launch",
+      [EXECUTED_EVENT] = "event/executed",
+  };
+
+  struct CommandAck ack;
+  while (xQueueReceive(params->ack_queue, &ack, 0) == pdTRUE) {
+    char payload[80] = {0};
+    snprintf(payload, sizeof(payload),
+             "{\"ok\":%u,\"status\":%u,\"count\":%u,\"src\":%u,\"seq\":%" PRIu32 "}",
+             (unsigned int)(ack.status != ACK_REJECTED), (unsigned int)ack.status,
+             (unsigned int)ack.count, (unsigned int)ack.src, ack.seq);
+    publish(params->client, ACK_TOPICS[ack.type], payload);
+  }
 }
 
 /* Task to publish status periodically */
-void vPublishTask(void *pvParameters) {
-  struct PublishTaskParameters *params = (struct PublishTaskParameters *)pvParameters;
+/*
+ * Publish schedule
+ *
+ * Time is split into 50 ms slots, on server time once the server has sent it so every duck
+ * shares the same slot boundaries. Each duck takes its own slots from its ID, so the fleet
+ * spreads its publishes instead of bursting together. IDs 0 to 19 get distinct 1 Hz slots and
+ * IDs 0 to 99 distinct 5 s slots, the slow slot never shares the duck's 1 Hz slot.
+ * show/fleet_publish_sim.py compares this against the old boot relative schedule.
+ */
+enum { PUBLISH_SLOT_MS = 50, FAST_PERIOD_SLOTS = 20, SLOW_PERIOD_SLOTS = 100 };
+enum { FAST_SLOT = DUCK_ID_NUM % FAST_PERIOD_SLOTS };
+enum { SLOW_SLOT = (DUCK_ID_NUM * 21 + 10) % SLOW_PERIOD_SLOTS };
+
+static uint32_t get_schedule_time_ms() {
+  uint32_t now_ms;
+  if (!get_server_time_ms(&now_ms)) {
+    now_ms = xTaskGetTickCount() * portTICK_PERIOD_MS;
+  }
+  return now_ms;
+}
 
+// Sent once, after the first connection
+static void publish_boot_metrics(mqtt_client_t *client) {
   // Get 64bit Unique ID
   // Todo: Make this a boot log
   char id[9];  // 8 bytes plus null terminator
@@ -142,58 +357,124 @@ void vPublishTask(void *pvParameters) {
   }
   printf("\n");
 
-  // Todo: remove this, and add semaphore to mqtt_connection_cb
-  vTaskDelay(1000);
+  publish_metric(client, TM_BOOT_COUNT, bootCount());
+  publish_metric(client, TM_SOFT_REBOOT_REASON, rebootReasonSoft());
+  publish_metric(client, TM_HARD_REBOOT_REASON, rebootReasonHard());
+  publish_mac(client);
+  publish_metric(client, TM_FIRMWARE_VERSION, FIRMWARE_VERSION);
+  frame_send(client);
+}
 
-  // Publish boot metrics
-  publish_int(params->client, "metric/boot_count", bootCount());
-  publish_int(params->client, "metric/soft_reboot_reason", rebootReasonSoft());
-  publish_int(params->client, "metric/hard_reboot_reason", rebootReasonHard());
-  publish_mac(params->client);
-  publish_int(params->client, "metric/firmware_version", FIRMWARE_VERSION);
+// Sleeps to the start of the next slot, a resync can land in the same slot again
+static uint32_t wait_next_slot(uint32_t last_slot) {
+  uint32_t slot;
+  do {
+    uint32_t now_ms = get_schedule_time_ms();
+    vTaskDelay(PUBLISH_SLOT_MS - (now_ms % PUBLISH_SLOT_MS));
+    slot = get_schedule_time_ms() / PUBLISH_SLOT_MS;
+  } while (slot == last_slot);
+  return slot;
+}
 
-  vTaskDelay(1000);
+// 20 Hz - Every slot
+static void publish_every_slot(struct PublishTaskParameters *params) {
+  publish_acks(params);
+  publish_mag_stream(params);
+  publish_trace_dump(params->client);
+}
 
-  unsigned int count = 0;
+// 1 Hz - This duck's slot in the second
+static void publish_fast_group(struct PublishTaskParameters *params) {
+  publish_fast_telemetry(params);
+  publish_offline_time(params->client);
+  publish_metric(params->client, TM_PUBLISH_SLOT_MS,
+                 get_schedule_time_ms() % (FAST_PERIOD_SLOTS * PUBLISH_SLOT_MS));
+}
+
+// 0.1 Hz - Modes, settings and housekeeping
+static void publish_slow_group_a(struct PublishTaskParameters *params) {
+  mqtt_client_t *client = params->client;
+  publish_duck_mode(params);
+  publish_metric(client, TM_TEMP_RP2040_C, get_temp_C());
+  publish_metric(client, TM_BATTERY_V, get_battery_V());
+  publish_metric(client, TM_DANCE_COUNT, get_dance_count());
+  publish_metric(client, TM_MQTT_PUB_CB_ERR_CNT, callback_error_count);
+  publish_metric(client, TM_MOTOR_CMD_RX_CNT, get_motor_command_rx_count());
+  publish_metric(client, TM_IS_CALIBRATED, (uint32_t)is_calibrated());
+  publish_metric(client, TM_MOTOR_DRV_ERROR_COUNT, get_motor_drv_error_count());
+  publish_metric(client, TM_WIND_CORRECTION_COUNT, get_wind_correction_counter());
+  publish_metric(client, TM_CHOREOGRAPHY_HASH, get_choreography_hash());
+  publish_metric(client, TM_GROUP_MASK, get_group_mask());
+  publish_metric(client, TM_GROUP_SAVE_ERR_CNT, get_group_save_error_count());
+  publish_metric(client, TM_WIFI_AP_INDEX, get_wifi_ap_index());
+  publish_metric(client, TM_MQTT_BROKER_INDEX, get_mqtt_broker_index());
+  publish_metric(client, TM_MQTT_RECONNECT_CNT, get_mqtt_reconnect_count());
+  publish_metric(client, TM_MQTT_DOWNTIME_MS, get_mqtt_downtime_ms());
+  publish_metric(client, TM_CHOREOGRAPHY_ROUTINES, get_choreography_routine_count());
+  publish_runtime_stats(client);
+}
+
+// 0.1 Hz - Error counters and latencies
+static void publish_slow_group_b(struct PublishTaskParameters *params) {
+  mqtt_client_t *client = params->client;
+  publish_metric(client, TM_BAD_JSON_COUNT, get_bad_json_count());
+  publish_metric(client, TM_BAD_BINARY_COUNT, get_bad_binary_count());
+  publish_metric(client, TM_MOTOR_QUEUE_ERROR_CNT, get_motor_queue_error_count());
+  publish_metric(client, TM_SET_MAG_MB_ERR_CNT, get_mag_mailbox_set_error_count());
+  publish_metric(client, TM_MAG_CFG_ERR_CNT, get_config_fail_count());
+  publish_metric(client, TM_DANCE_SERVER_TIME, get_dance_server_time_raw_ms());
+  publish_metric(client, TM_DANCE_SERVER_TIME_CALC, get_dance_server_time_calc_ms());
+  publish_metric(client, TM_MQTT_RX_COUNT, get_mqtt_rx_count());
+  publish_metric(client, TM_MQTT_INPUB_CB_MAX_US, get_mqtt_inpub_cb_max_us());
+  publish_metric(client, TM_MQTT_DATA_CB_MAX_US, get_mqtt_data_cb_max_us());
+  publish_metric(client, TM_COMMAND_BACKLOG_MAX, get_command_backlog_max());
+  publish_metric(client, TM_COMMAND_DROP_CNT, get_command_drop_count());
+  publish_metric(client, TM_MQTT_PAYLOAD_OVERFLOW_CNT, get_mqtt_payload_overflow_count());
+  publish_metric(client, TM_STOP_DROP_CNT, get_stop_drop_count());
+  publish_metric(client, TM_DUPLICATE_CMD_CNT, get_duplicate_command_count());
+  publish_metric(client, TM_STALE_CMD_CNT, get_stale_command_count());
+  publish_metric(client, TM_TELEMETRY_SUPPRESSED_CNT, get_telemetry_suppressed_count());
+  publish_metric(client, TM_TELEMETRY_SHED_CNT, get_telemetry_shed_count());
+  publish_metric(client, TM_MAG_STREAM_DROP_CNT, get_mag_stream_drop_count());
+  publish_metric(client, TM_LOG_OVERFLOW_CNT, get_log_overflow_count());
+  publish_metric(client, TM_CHOREOGRAPHY_REJECT_CNT, get_choreography_reject_count());
+  publish_lane_latency(client);
+  publish_latency_summaries(client);
+}
+
+void vPublishTask(void *pvParameters) {
+  struct PublishTaskParameters *params = (struct PublishTaskParameters *)pvParameters;
+
+  // Boot metrics are only sent once, wait for the connection task to reach a broker
+  while (!is_mqtt_connected()) {
+    vTaskDelay(100);
+  }
+  publish_boot_metrics(params->client);
+
+  uint32_t slot = get_schedule_time_ms() / PUBLISH_SLOT_MS;
 
   for (;;) {
-    check_continuous_error_count();
+    slot = wait_next_slot(slot);
 
-    // 10 Hz - 100ms - Always evaluates to true
-    if (count % 1 == 0) {
-      // blank
+    // Offline slots are skipped rather than counted as errors, the connection task handles it
+    if (!is_mqtt_connected()) {
+      continue;
     }
-    // 1 Hz - 1000ms
-    if (count % 10 == 0) {
-      publish_magnetometer_metrics(params);
-      publish_rssi(params->client);
-      publish_int(params->client, "metric/mqtt_pub_err_cnt", publish_error_count);
-      publish_int(params->client, "metric/current_dance", get_current_dance());
+
+    trace_begin(TRACE_PUBLISH_SLOT, slot);
+    publish_every_slot(params);
+    if (slot % FAST_PERIOD_SLOTS == FAST_SLOT) {
+      publish_fast_group(params);
     }
-    // 0.1 Hz - 10s - Offset and alternate to smooth traffic
-    const uint32_t offset_count = 25;
-    if ((count + offset_count) % 100 == 0) {
-      publish_duck_mode(params);
-      publish_float(params->client, "sensor/temp_rp2040_C", get_temp_C());
-      publish_float(params->client, "sensor/battery_V", get_battery_V());
-      publish_int(params->client, "metric/dance_count", get_dance_count());
-      publish_int(params->client, "metric/mqtt_pub_cb_err_cnt", callback_error_count);
-      publish_int(params->client, "metric/motor_cmd_rx_cnt", get_motor_command_rx_count());
-      publish_int(params->client, "metric/is_calibrated", (uint32_t)is_calibrated());
-      publish_int(params->client, "metric/motor_drv_error_count", get_motor_drv_error_count());
-      publish_int(params->client, "metric/wind_correction_count", get_wind_correction_counter());
-    } else if ((count + offset_count) % 50 == 0) {
-      publish_int(params->client, "metric/bad_json_count", get_bad_json_count());
-      publish_int(params->client, "metric/mqtt_pub_cb_err_cnt", callback_error_count);
-      publish_int(params->client, "metric/motor_queue_error_cnt", get_motor_queue_error_count());
-      publish_int(params->client, "metric/set_mag_mb_err_cnt", get_mag_mailbox_set_error_count());
-      publish_int(params->client, "metric/mag_cfg_err_cnt", get_config_fail_count());
-      publish_int(params->client, "metric/dance_server_time", get_dance_server_time_raw_ms());
-      publish_int(params->client, "metric/dance_server_time_calc", get_dance_server_time_calc_ms());
-      publish_int(params->client, "metric/mqtt_rx_count", get_mqtt_rx_count());
+    // Two groups alternating every 5 s, in this duck's slot of the 5 s
+    if (slot % (2 * SLOW_PERIOD_SLOTS) == SLOW_SLOT) {
+      publish_slow_group_a(params);
+    } else if (slot % (2 * SLOW_PERIOD_SLOTS) == SLOW_SLOT + SLOW_PERIOD_SLOTS) {
+      publish_slow_group_b(params);
     }
 
-    count++;
-    vTaskDelay(100);
+    // Everything sampled this slot goes out as one publish
+    frame_send(params->client);
+    trace_end(TRACE_PUBLISH_SLOT);
   }
-}
\ No newline at end of file
+}
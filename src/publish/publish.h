@@ -10,9 +10,17 @@
 struct PublishTaskParameters {
   mqtt_client_t *client;
   QueueHandle_t mag;
+  QueueHandle_t mag_stream;
   QueueHandle_t duck_mode_mailbox;
+  QueueHandle_t ack_queue;
 };
 
+// Publishes to dancing_duck/devices/<id>/<topic>
+// False when lwIP did not take the publish, usually a full output ring
+bool publish_payload(mqtt_client_t *client, const char *topic, const void *payload, size_t len,
+                     uint8_t qos);
+// Sends lines from the log task to the log topic
+void publish_log(mqtt_client_t *client, const char *text, size_t len);
 void vPublishTask(void *pvParameters);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,84 @@
+#include "pico/stdlib.h"
+
+#include "latency.h"
+
+/*
+ * Log bucket histograms, four buckets per power of two, so a bucket is within 25% of its value
+ * The writer only ever increments its counts. The reader keeps the counts it saw at its last
+ * read and reports the difference, so neither side locks and no sample is lost to a reset.
+ */
+enum { SUB_BUCKET_BITS = 2, SUB_BUCKETS = 1 << SUB_BUCKET_BITS };
+enum { LATENCY_BUCKETS = 96 };                            // Up to 2^25 us
+static const uint32_t LATENCY_CLAMP_US = (1u << 25) - 1;  // Top of the last bucket
+
+struct LatencyHistogram {
+  volatile uint32_t counts[LATENCY_BUCKETS];
+  volatile uint32_t max_us;
+  uint32_t read_counts[LATENCY_BUCKETS];
+};
+
+static struct LatencyHistogram histograms[NUM_LATENCY_PATHS];
+
+// This function has early exits
+static uint32_t bucket_index(uint32_t us) {
+  if (us < SUB_BUCKETS) {
+    return us;  // Early Exit!
+  }
+  uint32_t exponent = 31 - (uint32_t)__builtin_clz(us);
+  uint32_t sub = (us >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+  return (exponent - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + sub;
+}
+
+// This function has early exits
+static uint32_t bucket_upper_us(uint32_t index) {
+  if (index < SUB_BUCKETS) {
+    return index;  // Early Exit!
+  }
+  uint32_t shift = index / SUB_BUCKETS - 1;
+  uint32_t lower = (SUB_BUCKETS + index % SUB_BUCKETS) << shift;
+  return lower + (1u << shift) - 1;
+}
+
+void record_latency(enum LatencyPath path, uint32_t elapsed_us) {
+  struct LatencyHistogram *h = &histograms[path];
+  uint32_t us = (elapsed_us < LATENCY_CLAMP_US) ? elapsed_us : LATENCY_CLAMP_US;
+  h->counts[bucket_index(us)]++;
+  if (elapsed_us > h->max_us) {
+    h->max_us = elapsed_us;
+  }
+}
+
+// Upper edge of the bucket holding the rank, capped at the max seen
+static uint32_t quantile_us(const uint32_t *deltas, uint32_t count, uint32_t rank,
+                            uint32_t max_us) {
+  uint32_t seen = 0;
+  for (uint32_t i = 0; i < LATENCY_BUCKETS; i++) {
+    seen += deltas[i];
+    if (seen >= rank) {
+      uint32_t upper_us = bucket_upper_us(i);
+      return ((max_us > 0) && (upper_us > max_us)) ? max_us : upper_us;
+    }
+  }
+  return (count > 0) ? max_us : 0;
+}
+
+void read_latency_summary(enum LatencyPath path, struct LatencySummary *summary) {
+  struct LatencyHistogram *h = &histograms[path];
+  uint32_t deltas[LATENCY_BUCKETS];
+  uint32_t count = 0;
+
+  for (uint32_t i = 0; i < LATENCY_BUCKETS; i++) {
+    uint32_t now = h->counts[i];
+    deltas[i] = now - h->read_counts[i];
+    h->read_counts[i] = now;
+    count += deltas[i];
+  }
+
+  // A sample landing between these two lines can lose its max, as with the other max metrics
+  summary->max_us = h->max_us;
+  h->max_us = 0;
+
+  summary->count = count;
+  summary->p50_us = quantile_us(deltas, count, (count + 1) / 2, summary->max_us);
+  summary->p99_us = quantile_us(deltas, count, count - count / 100, summary->max_us);
+}
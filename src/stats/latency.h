@@ -0,0 +1,27 @@
+#ifndef _DD_LATENCY_H
+#define _DD_LATENCY_H
+
+#include "stdint.h"
+
+// Timed paths, each recorded from a single task or callback
+enum LatencyPath {
+  LATENCY_MOTOR_LOOP_PERIOD,   // Start to start of the motor loop, timed wakes only
+  LATENCY_MAG_READ,            // get_xyz_uT()
+  LATENCY_MQTT_DATA_CB,        // Time in mqtt_incoming_data_cb()
+  LATENCY_COMMAND_TO_MOTOR,    // Publish received to set_motor(), stop and override lanes
+  NUM_LATENCY_PATHS
+};
+
+struct LatencySummary {
+  uint32_t count;
+  uint32_t p50_us;  // Upper edge of the bucket, within 25%
+  uint32_t p99_us;
+  uint32_t max_us;
+};
+
+// Never blocks, a few instructions, values from 33 seconds up share the last bucket
+void record_latency(enum LatencyPath path, uint32_t elapsed_us);
+// Samples since the previous read of the path, only the publish task reads
+void read_latency_summary(enum LatencyPath path, struct LatencySummary *summary);
+
+#endif
@@ -0,0 +1,73 @@
+#include "FreeRTOS.h"
+
+#include "pico/stdlib.h"
+
+#include "stats.h"
+#include "task.h"
+
+struct TaskEntry {
+  TaskHandle_t handle;
+  const char *name;
+  configRUN_TIME_COUNTER_TYPE last_run_time;
+};
+
+static struct TaskEntry task_entries[MAX_STATS_TASKS];
+static size_t num_task_entries = 0;
+static configRUN_TIME_COUNTER_TYPE last_idle_run_time[STATS_CORES];
+static configRUN_TIME_COUNTER_TYPE last_sample_time = 0;
+
+// This function has early exits
+void register_task_stats(TaskHandle_t task, const char *name) {
+  if ((task == NULL) || (num_task_entries >= MAX_STATS_TASKS)) {
+    return;  // Early Exit!
+  }
+  task_entries[num_task_entries].handle = task;
+  task_entries[num_task_entries].name = name;
+  task_entries[num_task_entries].last_run_time = 0;
+  num_task_entries++;
+  vTaskSetTaskNumber(task, num_task_entries);
+}
+
+// This function has early exits
+const char *get_task_stats_name(uint32_t number) {
+  if ((number == 0) || (number > num_task_entries)) {
+    return NULL;  // Early Exit!
+  }
+  return task_entries[number - 1].name;
+}
+
+static double percent_of(configRUN_TIME_COUNTER_TYPE part, configRUN_TIME_COUNTER_TYPE whole) {
+  return (whole > 0) ? 100.0 * (double)part / (double)whole : 0.0;
+}
+
+/*
+ * uxTaskGetSystemState() suspends the scheduler to walk every task list, instead each counter is
+ * read on its own. ulTaskGetRunTimeCounter() only takes a short critical section.
+ * Counters are in microseconds and wrap every 71 minutes, the differences stay correct.
+ * Core load relies on main.c pinning each idle task to its core.
+ */
+void sample_runtime_stats(struct RuntimeStats *rs) {
+  configRUN_TIME_COUNTER_TYPE now = portGET_RUN_TIME_COUNTER_VALUE();
+  configRUN_TIME_COUNTER_TYPE elapsed = now - last_sample_time;
+  last_sample_time = now;
+
+  for (BaseType_t core = 0; core < STATS_CORES; core++) {
+    configRUN_TIME_COUNTER_TYPE idle =
+        ulTaskGetRunTimeCounter(xTaskGetIdleTaskHandleForCore(core));
+    rs->core_load_pct[core] = 100.0 - percent_of(idle - last_idle_run_time[core], elapsed);
+    last_idle_run_time[core] = idle;
+  }
+
+  rs->task_count = num_task_entries;
+  for (size_t i = 0; i < num_task_entries; i++) {
+    struct TaskEntry *entry = &task_entries[i];
+    configRUN_TIME_COUNTER_TYPE run_time = ulTaskGetRunTimeCounter(entry->handle);
+    rs->tasks[i].name = entry->name;
+    rs->tasks[i].cpu_pct = percent_of(run_time - entry->last_run_time, elapsed);
+    rs->tasks[i].stack_free_bytes =
+        (uint32_t)(uxTaskGetStackHighWaterMark(entry->handle) * sizeof(StackType_t));
+    entry->last_run_time = run_time;
+  }
+
+  rs->min_free_heap_bytes = (uint32_t)xPortGetMinimumEverFreeHeapSize();
+}
@@ -0,0 +1,33 @@
+#ifndef _DD_STATS_H
+#define _DD_STATS_H
+
+#include "FreeRTOS.h"
+
+#include "stdint.h"
+#include "task.h"
+
+enum { MAX_STATS_TASKS = 16, STATS_CORES = 2 };
+
+struct TaskStats {
+  const char *name;  // Short tag, no spaces
+  double cpu_pct;    // Of one core, since the last sample
+  uint32_t stack_free_bytes;
+};
+
+struct RuntimeStats {
+  double core_load_pct[STATS_CORES];
+  uint32_t min_free_heap_bytes;
+  size_t task_count;
+  struct TaskStats tasks[MAX_STATS_TASKS];
+};
+
+// Adds a task to the samples, name must be a string literal
+// Also sets the task number, from 1 in the order registered, the trace records use it
+void register_task_stats(TaskHandle_t task, const char *name);
+// NULL when no task has the number
+const char *get_task_stats_name(uint32_t number);
+
+// Loads since the previous call, from the run time counters without suspending the scheduler
+void sample_runtime_stats(struct RuntimeStats *rs);
+
+#endif
@@ -0,0 +1,392 @@
+#include <inttypes.h>
+#include <math.h>
+#include <string.h>
+
+#include "FreeRTOS.h"
+
+#include "pico/cyw43_arch.h"
+#include "pico/printf.h"
+#include "pico/stdlib.h"
+
+#include "lwip/apps/mqtt.h"
+#include "lwip/apps/mqtt_priv.h"
+
+#include "config.h"
+#include "publish.h"
+#include "task.h"
+#include "telemetry.h"
+
+/*
+ * Telemetry policy
+ *
+ * Sensors and windowed maxima go every sample at QoS 0, they are stale by the next sample anyway.
+ * Modes, settings and counters go at QoS 1, only when they change, with a heartbeat so a flat
+ * series still shows in Grafana: 60 s for modes and settings, 300 s for counters.
+ * Analog housekeeping goes at QoS 0 once it moves by more than its deadband.
+ * Events are sampled only when something happened, and always go at QoS 1.
+ */
+enum TelemetryFormat { FORMAT_FLOAT, FORMAT_INT, FORMAT_UINT };
+
+struct TelemetryPolicy {
+  const char *metric;  // "<measurement_type>/<name>", as the old per metric topics
+  enum TelemetryFormat format;
+  uint8_t qos;
+  bool on_change;           // Skip samples within the deadband of the last value sent...
+  double deadband;
+  uint32_t max_interval_s;  // ...unless it has not been sent for this long
+};
+
+static const struct TelemetryPolicy TELEMETRY_POLICIES[NUM_TELEMETRY_METRICS] = {
+    [TM_OFFLINE_MS] = {"metric/offline_ms", FORMAT_UINT, 1, false, 0.0, 0},
+    [TM_DUCK_MODE] = {"metric/duck_mode", FORMAT_INT, 1, true, 0.0, 60},
+    [TM_MAG_X_UT] = {"sensor/mag_x_uT", FORMAT_FLOAT, 0, false, 0.0, 0},
+    [TM_MAG_Y_UT] = {"sensor/mag_y_uT", FORMAT_FLOAT, 0, false, 0.0, 0},
+    [TM_MAG_Z_UT] = {"sensor/mag_z_uT", FORMAT_FLOAT, 0, false, 0.0, 0},
+    [TM_MAG_CALIBRATED_X_UT] = {"sensor/mag_calibrated_x_uT", FORMAT_FLOAT, 0, false, 0.0, 0},
+    [TM_MAG_CALIBRATED_Y_UT] = {"sensor/mag_calibrated_y_uT", FORMAT_FLOAT, 0, false, 0.0, 0},
+    [TM_HEADING] = {"sensor/heading", FORMAT_FLOAT, 0, false, 0.0, 0},
+    [TM_KASA_RMSE] = {"metric/kasa_rmse", FORMAT_FLOAT, 0, false, 0.0, 0},
+    [TM_RSSI] = {"metric/rssi", FORMAT_INT, 0, true, 3.0, 60},
+    [TM_MQTT_PUB_ERR_CNT] = {"metric/mqtt_pub_err_cnt", FORMAT_INT, 1, true, 0.0, 300},
+    [TM_CURRENT_DANCE] = {"metric/current_dance", FORMAT_INT, 1, true, 0.0, 60},
+    [TM_ESTOP_COUNT] = {"metric/estop_count", FORMAT_UINT, 1, true, 0.0, 300},
+    [TM_ESTOP_CB_TO_PWM_US] = {"metric/estop_cb_to_pwm_us", FORMAT_UINT, 1, true, 0.0, 300},
+    [TM_STOP_LANE_LATENCY_MAX_US] = {"metric/stop_lane_latency_max_us", FORMAT_UINT,
+                                     0, false, 0.0, 0},
+    [TM_OVERRIDE_LANE_LATENCY_MAX_US] = {"metric/override_lane_latency_max_us", FORMAT_UINT,
+                                         0, false, 0.0, 0},
+    [TM_CORRECTIVE_LANE_LATENCY_MAX_US] = {"metric/corrective_lane_latency_max_us", FORMAT_UINT,
+                                           0, false, 0.0, 0},
+    [TM_DANCE_LANE_LATENCY_MAX_US] = {"metric/dance_lane_latency_max_us", FORMAT_UINT,
+                                      0, false, 0.0, 0},
+    [TM_BOOT_COUNT] = {"metric/boot_count", FORMAT_INT, 1, false, 0.0, 0},
+    [TM_SOFT_REBOOT_REASON] = {"metric/soft_reboot_reason", FORMAT_INT, 1, false, 0.0, 0},
+    [TM_HARD_REBOOT_REASON] = {"metric/hard_reboot_reason", FORMAT_INT, 1, false, 0.0, 0},
+    [TM_FIRMWARE_VERSION] = {"metric/firmware_version", FORMAT_INT, 1, false, 0.0, 0},
+    [TM_TEMP_RP2040_C] = {"sensor/temp_rp2040_C", FORMAT_FLOAT, 0, true, 1.0, 60},
+    [TM_BATTERY_V] = {"sensor/battery_V", FORMAT_FLOAT, 0, true, 0.05, 60},
+    [TM_DANCE_COUNT] = {"metric/dance_count", FORMAT_INT, 1, true, 0.0, 300},
+    [TM_MQTT_PUB_CB_ERR_CNT] = {"metric/mqtt_pub_cb_err_cnt", FORMAT_INT, 1, true, 0.0, 300},
+    [TM_MOTOR_CMD_RX_CNT] = {"metric/motor_cmd_rx_cnt", FORMAT_INT, 1, true, 0.0, 300},
+    [TM_IS_CALIBRATED] = {"metric/is_calibrated", FORMAT_INT, 1, true, 0.0, 60},
+    [TM_MOTOR_DRV_ERROR_COUNT] = {"metric/motor_drv_error_count", FORMAT_INT, 1, true, 0.0, 300},
+    [TM_WIND_CORRECTION_COUNT] = {"metric/wind_correction_count", FORMAT_INT, 1, true, 0.0, 300},
+    [TM_CHOREOGRAPHY_HASH] = {"metric/choreography_hash", FORMAT_UINT, 1, true, 0.0, 60},
+    [TM_GROUP_MASK] = {"metric/group_mask", FORMAT_UINT, 1, true, 0.0, 60},
+    [TM_GROUP_SAVE_ERR_CNT] = {"metric/group_save_err_cnt", FORMAT_UINT, 1, true, 0.0, 300},
+    [TM_WIFI_AP_INDEX] = {"metric/wifi_ap_index", FORMAT_UINT, 1, true, 0.0, 60},
+    [TM_MQTT_BROKER_INDEX] = {"metric/mqtt_broker_index", FORMAT_UINT, 1, true, 0.0, 60},
+    [TM_MQTT_RECONNECT_CNT] = {"metric/mqtt_reconnect_cnt", FORMAT_UINT, 1, true, 0.0, 300},
+    [TM_MQTT_DOWNTIME_MS] = {"metric/mqtt_downtime_ms", FORMAT_UINT, 1, true, 0.0, 300},
+    [TM_CHOREOGRAPHY_ROUTINES] = {"metric/choreography_routines", FORMAT_INT, 1, true, 0.0, 60},
+    [TM_BAD_JSON_COUNT] = {"metric/bad_json_count", FORMAT_INT, 1, true, 0.0, 300},
+    [TM_BAD_BINARY_COUNT] = {"metric/bad_binary_count", FORMAT_UINT, 1, true, 0.0, 300},
+    [TM_MOTOR_QUEUE_ERROR_CNT] = {"metric/motor_queue_error_cnt", FORMAT_INT, 1, true, 0.0, 300},
+    [TM_SET_MAG_MB_ERR_CNT] = {"metric/set_mag_mb_err_cnt", FORMAT_INT, 1, true, 0.0, 300},
+    [TM_MAG_CFG_ERR_CNT] = {"metric/mag_cfg_err_cnt", FORMAT_INT, 1, true, 0.0, 300},
+    [TM_DANCE_SERVER_TIME] = {"metric/dance_server_time", FORMAT_INT, 0, false, 0.0, 0},
+    [TM_DANCE_SERVER_TIME_CALC] = {"metric/dance_server_time_calc", FORMAT_INT, 0, false, 0.0, 0},
+    [TM_MQTT_RX_COUNT] = {"metric/mqtt_rx_count", FORMAT_INT, 1, true, 0.0, 300},
+    [TM_MQTT_INPUB_CB_MAX_US] = {"metric/mqtt_inpub_cb_max_us", FORMAT_UINT, 0, false, 0.0, 0},
+    [TM_MQTT_DATA_CB_MAX_US] = {"metric/mqtt_data_cb_max_us", FORMAT_UINT, 0, false, 0.0, 0},
+    [TM_COMMAND_BACKLOG_MAX] = {"metric/command_backlog_max", FORMAT_UINT, 0, false, 0.0, 0},
+    [TM_COMMAND_DROP_CNT] = {"metric/command_drop_cnt", FORMAT_UINT, 1, true, 0.0, 300},
+    [TM_MQTT_PAYLOAD_OVERFLOW_CNT] = {"metric/mqtt_payload_overflow_cnt", FORMAT_UINT,
+                                      1, true, 0.0, 300},
+    [TM_STOP_DROP_CNT] = {"metric/stop_drop_cnt", FORMAT_UINT, 1, true, 0.0, 300},
+    [TM_DUPLICATE_CMD_CNT] = {"metric/duplicate_cmd_cnt", FORMAT_UINT, 1, true, 0.0, 300},
+    [TM_STALE_CMD_CNT] = {"metric/stale_cmd_cnt", FORMAT_UINT, 1, true, 0.0, 300},
+    [TM_CHOREOGRAPHY_REJECT_CNT] = {"metric/choreography_reject_cnt", FORMAT_INT,
+                                    1, true, 0.0, 300},
+    [TM_TELEMETRY_SUPPRESSED_CNT] = {"metric/telemetry_suppressed_cnt", FORMAT_UINT,
+                                     1, true, 0.0, 300},
+    [TM_TELEMETRY_SHED_LEVEL] = {"metric/telemetry_shed_level", FORMAT_UINT, 1, true, 0.0, 60},
+    [TM_TELEMETRY_SHED_CNT] = {"metric/telemetry_shed_cnt", FORMAT_UINT, 1, true, 0.0, 300},
+    [TM_PUBLISH_SLOT_MS] = {"metric/publish_slot_ms", FORMAT_UINT, 0, true, 20.0, 60},
+    [TM_MAG_STREAM_DROP_CNT] = {"metric/mag_stream_drop_cnt", FORMAT_UINT, 1, true, 0.0, 300},
+    [TM_LOG_OVERFLOW_CNT] = {"metric/log_overflow_cnt", FORMAT_UINT, 1, true, 0.0, 300},
+    [TM_CORE0_LOAD_PCT] = {"metric/core0_load_pct", FORMAT_FLOAT, 0, false, 0.0, 0},
+    [TM_CORE1_LOAD_PCT] = {"metric/core1_load_pct", FORMAT_FLOAT, 0, false, 0.0, 0},
+    [TM_HEAP_MIN_FREE_BYTES] = {"metric/heap_min_free_bytes", FORMAT_UINT, 1, true, 0.0, 300},
+};
+
+struct TelemetryState {
+  bool sent;
+  double last_value;
+  uint32_t last_sent_ms;
+  double frame_value;  // In the current frame, becomes last_value once the frame is accepted
+  uint32_t frame_ms;
+};
+
+static struct TelemetryState telemetry_state[NUM_TELEMETRY_METRICS];
+static uint32_t telemetry_suppressed_count = 0;
+
+static const uint32_t FAST_TELEMETRY_PERIOD_S[NUM_SHED_LEVELS] = {
+    [SHED_NONE] = 1,
+    [SHED_REDUCED] = 2,
+    [SHED_MINIMAL] = 5,
+};
+
+static enum ShedLevel shed_level = SHED_NONE;
+static uint32_t shed_clear_s = 0;
+static uint32_t telemetry_shed_count = 0;
+
+/*
+ * Telemetry frame
+ *
+ * Every metric due in a tick is added to one payload and sent as a single publish.
+ * Influx line protocol, one line per metric, for example
+ *   heading,measurement_type=sensor value=123.4567
+ * Names and tags match the old sensor/<name> and metric/<name> topics, so the stored series
+ * do not change. Values are written without the integer suffix, they were stored as floats.
+ */
+static struct {
+  size_t len;
+  uint8_t qos;  // Highest QoS of the metrics in the frame
+  char buffer[TELEMETRY_FRAME_MAX_BYTES];
+  size_t on_change_count;  // Change only metrics in the frame, marked sent once it is accepted
+  enum TelemetryMetric on_change[NUM_TELEMETRY_METRICS];
+} frame;
+
+// A frame lwIP does not take is dropped, its change only metrics go again on their next sample
+void frame_send(mqtt_client_t *client) {
+  if (frame.len > 0) {
+    bool accepted = publish_payload(client, "telemetry", frame.buffer, frame.len, frame.qos);
+    for (size_t i = 0; accepted && (i < frame.on_change_count); i++) {
+      struct TelemetryState *state = &telemetry_state[frame.on_change[i]];
+      state->sent = true;
+      state->last_value = state->frame_value;
+      state->last_sent_ms = state->frame_ms;
+    }
+    frame.len = 0;
+    frame.qos = 0;
+    frame.on_change_count = 0;
+  }
+}
+
+// The metric is "<measurement_type>/<name>", as the old topics were
+// Tags are empty or ",<key>=<value>" pairs added after measurement_type
+// Fields are "<key>=<value>" pairs separated by commas
+// This function has early exits
+bool frame_add_fields(mqtt_client_t *client, const char *metric, const char *tags,
+                      const char *fields, uint8_t qos) {
+  const char *name = strchr(metric, '/');
+  if (name == NULL) {
+    return false;  // Early Exit!
+  }
+
+  for (int attempt = 0; attempt < 2; attempt++) {
+    size_t space = sizeof(frame.buffer) - frame.len;
+    int len = snprintf(&frame.buffer[frame.len], space, "%s,measurement_type=%.*s%s %s\n",
+                       name + 1, (int)(name - metric), metric, tags, fields);
+    if ((len > 0) && ((size_t)len < space)) {
+      frame.len += (size_t)len;
+      frame.qos = (qos > frame.qos) ? qos : frame.qos;
+      return true;  // Early Exit!
+    }
+    // Full, send what is there and start a new frame
+    frame_send(client);
+  }
+  return false;
+}
+
+bool frame_add(mqtt_client_t *client, const char *metric, const char *tags, const char *value,
+               uint8_t qos) {
+  char fields[40];
+  snprintf(fields, sizeof(fields), "value=%s", value);
+  return frame_add_fields(client, metric, tags, fields, qos);
+}
+
+// Applies the metric's policy, then adds it to this tick's frame
+// This function has early exits
+void publish_metric(mqtt_client_t *client, enum TelemetryMetric id, double val) {
+  const struct TelemetryPolicy *policy = &TELEMETRY_POLICIES[id];
+  struct TelemetryState *state = &telemetry_state[id];
+  uint32_t now_ms = xTaskGetTickCount() * portTICK_PERIOD_MS;
+
+  if ((policy->qos == 0) && (shed_level >= (policy->on_change ? SHED_MINIMAL : SHED_REDUCED))) {
+    telemetry_shed_count++;
+    return;  // Early Exit!
+  }
+
+  if (policy->on_change && state->sent) {
+    bool changed = fabs(val - state->last_value) > policy->deadband;
+    bool stale = (now_ms - state->last_sent_ms) >= policy->max_interval_s * 1000;
+    if (!changed && !stale) {
+      telemetry_suppressed_count++;
+      return;  // Early Exit!
+    }
+  }
+
+  char value[32] = {0};
+  switch (policy->format) {
+    case FORMAT_FLOAT:
+      snprintf(value, sizeof(value), "%.4f", val);
+      break;
+    case FORMAT_INT:
+      snprintf(value, sizeof(value), "%" PRIi32 "", (int32_t)val);
+      break;
+    case FORMAT_UINT:
+    default:
+      snprintf(value, sizeof(value), "%" PRIu32 "", (uint32_t)val);
+      break;
+  }
+  bool added = frame_add(client, policy->metric, "", value, policy->qos);
+
+  if (added && policy->on_change && (frame.on_change_count < NUM_TELEMETRY_METRICS)) {
+    state->frame_value = val;
+    state->frame_ms = now_ms;
+    frame.on_change[frame.on_change_count++] = id;
+  }
+}
+
+static void publish_fast_text(mqtt_client_t *client, const struct FastTelemetry *ft) {
+  publish_metric(client, TM_MAG_X_UT, ft->raw.x_uT);
+  publish_metric(client, TM_MAG_Y_UT, ft->raw.y_uT);
+  publish_metric(client, TM_MAG_Z_UT, ft->raw.z_uT);
+  publish_metric(client, TM_MAG_CALIBRATED_X_UT, ft->calibrated.x_uT);
+  publish_metric(client, TM_MAG_CALIBRATED_Y_UT, ft->calibrated.y_uT);
+  publish_metric(client, TM_HEADING, ft->heading);
+  publish_metric(client, TM_KASA_RMSE, ft->kasa_rmse);
+  if (ft->rssi_valid) {
+    publish_metric(client, TM_RSSI, ft->rssi);
+  }
+  publish_metric(client, TM_MQTT_PUB_ERR_CNT, ft->publish_error_count);
+  publish_metric(client, TM_CURRENT_DANCE, ft->current_dance);
+  publish_metric(client, TM_ESTOP_COUNT, ft->estop_count);
+  publish_metric(client, TM_ESTOP_CB_TO_PWM_US, ft->estop_cb_to_pwm_us);
+}
+
+/*
+ * Binary telemetry record, version 1, little endian (56 bytes)
+ *
+ * uint8_t version
+ * uint8_t duck_id
+ * uint16_t reserved   0
+ * uint32_t tick_ms    Time since boot
+ * float mag_x_uT
+ * float mag_y_uT
+ * float mag_z_uT
+ * float mag_calibrated_x_uT
+ * float mag_calibrated_y_uT
+ * float heading
+ * float kasa_rmse
+ * int32_t rssi        0 when unknown
+ * uint32_t mqtt_pub_err_cnt
+ * int32_t current_dance
+ * uint32_t estop_count
+ * uint32_t estop_cb_to_pwm_us
+ *
+ * Decoded by the telemetry/bin consumer in server/telegraf.conf
+ */
+enum { TELEMETRY_RECORD_VERSION = 1, TELEMETRY_RECORD_WIRE_SIZE = 56 };
+
+uint8_t *put_u32_le(uint8_t *out, uint32_t value) {
+  out[0] = (uint8_t)value;
+  out[1] = (uint8_t)(value >> 8);
+  out[2] = (uint8_t)(value >> 16);
+  out[3] = (uint8_t)(value >> 24);
+  return out + 4;
+}
+
+uint8_t *put_float_le(uint8_t *out, double value) {
+  float f = (float)value;
+  uint32_t bits;
+  memcpy(&bits, &f, sizeof(bits));
+  return put_u32_le(out, bits);
+}
+
+// No string formatting, floats are packed as they are
+static void publish_fast_binary(mqtt_client_t *client, const struct FastTelemetry *ft) {
+  uint8_t record[TELEMETRY_RECORD_WIRE_SIZE];
+  uint8_t *out = record;
+
+  *out++ = TELEMETRY_RECORD_VERSION;
+  *out++ = (uint8_t)DUCK_ID_NUM;
+  *out++ = 0;
+  *out++ = 0;
+  out = put_u32_le(out, xTaskGetTickCount() * portTICK_PERIOD_MS);
+  out = put_float_le(out, ft->raw.x_uT);
+  out = put_float_le(out, ft->raw.y_uT);
+  out = put_float_le(out, ft->raw.z_uT);
+  out = put_float_le(out, ft->calibrated.x_uT);
+  out = put_float_le(out, ft->calibrated.y_uT);
+  out = put_float_le(out, ft->heading);
+  out = put_float_le(out, ft->kasa_rmse);
+  out = put_u32_le(out, ft->rssi_valid ? (uint32_t)ft->rssi : 0);
+  out = put_u32_le(out, ft->publish_error_count);
+  out = put_u32_le(out, (uint32_t)ft->current_dance);
+  out = put_u32_le(out, ft->estop_count);
+  put_u32_le(out, ft->estop_cb_to_pwm_us);
+
+  // High rate sensor data, the next record replaces a lost one
+  publish_payload(client, "telemetry/bin", record, sizeof(record), 0);
+}
+
+// Output ring bytes and publishes not yet sent or acked, both left over from earlier ticks
+// This function has early exits
+static enum ShedLevel measure_congestion(mqtt_client_t *client, const struct FastTelemetry *ft) {
+  cyw43_arch_lwip_begin();
+  int32_t ring_used = (int32_t)client->output.put - (int32_t)client->output.get;
+  if (ring_used < 0) {
+    ring_used += MQTT_OUTPUT_RINGBUF_SIZE;
+  }
+  uint32_t pending = 0;
+  for (struct mqtt_request_t *r = client->pend_req_queue; r != NULL; r = r->next) {
+    pending++;
+  }
+  cyw43_arch_lwip_end();
+
+  static uint32_t last_publish_error_count = 0;
+  bool publish_failed = (ft->publish_error_count != last_publish_error_count);
+  last_publish_error_count = ft->publish_error_count;
+
+  uint32_t ring_pct = (uint32_t)ring_used * 100 / MQTT_OUTPUT_RINGBUF_SIZE;
+  if (publish_failed || (ring_pct >= SHED_RING_MINIMAL_PCT) || (pending >= SHED_PENDING_MINIMAL)) {
+    return SHED_MINIMAL;  // Early Exit!
+  }
+  if ((ring_pct >= SHED_RING_REDUCED_PCT) || (pending >= SHED_PENDING_REDUCED) ||
+      (ft->rssi_valid && (ft->rssi < SHED_RSSI_POOR_DBM))) {
+    return SHED_REDUCED;  // Early Exit!
+  }
+  return SHED_NONE;
+}
+
+void update_shed_level(mqtt_client_t *client, const struct FastTelemetry *ft) {
+  enum ShedLevel congestion = measure_congestion(client, ft);
+
+  if (congestion >= shed_level) {
+    shed_level = congestion;
+    shed_clear_s = 0;
+  } else if (++shed_clear_s >= SHED_RECOVER_S) {
+    shed_level = (enum ShedLevel)(shed_level - 1);
+    shed_clear_s = 0;
+  }
+  publish_metric(client, TM_TELEMETRY_SHED_LEVEL, shed_level);
+}
+
+enum ShedLevel get_shed_level() { return shed_level; }
+
+uint32_t get_fast_telemetry_period_s() { return FAST_TELEMETRY_PERIOD_S[shed_level]; }
+
+// Per task and per path lines go first, they are the bulk of the slow groups
+// This function has early exits
+bool shed_extra_lines(uint32_t count) {
+  if (shed_level >= SHED_REDUCED) {
+    telemetry_shed_count += count;
+    return true;  // Early Exit!
+  }
+  return false;
+}
+
+uint32_t get_telemetry_suppressed_count() { return telemetry_suppressed_count; }
+
+uint32_t get_telemetry_shed_count() { return telemetry_shed_count; }
+
+void publish_fast_telemetry_record(mqtt_client_t *client, const struct FastTelemetry *ft) {
+  if (TELEMETRY_BINARY) {
+    publish_fast_binary(client, ft);
+  } else {
+    publish_fast_text(client, ft);
+  }
+}
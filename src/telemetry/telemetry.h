@@ -0,0 +1,132 @@
+#ifndef _DD_TELEMETRY_H
+#define _DD_TELEMETRY_H
+
+#include "lwip/apps/mqtt.h"
+
+#include "magnetometer.h"
+#include "stdbool.h"
+#include "stdint.h"
+
+// One id per metric, the name, format and send policy live in TELEMETRY_POLICIES in telemetry.c
+enum TelemetryMetric {
+  TM_OFFLINE_MS,
+  TM_DUCK_MODE,
+  TM_MAG_X_UT,
+  TM_MAG_Y_UT,
+  TM_MAG_Z_UT,
+  TM_MAG_CALIBRATED_X_UT,
+  TM_MAG_CALIBRATED_Y_UT,
+  TM_HEADING,
+  TM_KASA_RMSE,
+  TM_RSSI,
+  TM_MQTT_PUB_ERR_CNT,
+  TM_CURRENT_DANCE,
+  TM_ESTOP_COUNT,
+  TM_ESTOP_CB_TO_PWM_US,
+  TM_STOP_LANE_LATENCY_MAX_US,
+  TM_OVERRIDE_LANE_LATENCY_MAX_US,
+  TM_CORRECTIVE_LANE_LATENCY_MAX_US,
+  TM_DANCE_LANE_LATENCY_MAX_US,
+  TM_BOOT_COUNT,
+  TM_SOFT_REBOOT_REASON,
+  TM_HARD_REBOOT_REASON,
+  TM_FIRMWARE_VERSION,
+  TM_TEMP_RP2040_C,
+  TM_BATTERY_V,
+  TM_DANCE_COUNT,
+  TM_MQTT_PUB_CB_ERR_CNT,
+  TM_MOTOR_CMD_RX_CNT,
+  TM_IS_CALIBRATED,
+  TM_MOTOR_DRV_ERROR_COUNT,
+  TM_WIND_CORRECTION_COUNT,
+  TM_CHOREOGRAPHY_HASH,
+  TM_GROUP_MASK,
+  TM_GROUP_SAVE_ERR_CNT,
+  TM_WIFI_AP_INDEX,
+  TM_MQTT_BROKER_INDEX,
+  TM_MQTT_RECONNECT_CNT,
+  TM_MQTT_DOWNTIME_MS,
+  TM_CHOREOGRAPHY_ROUTINES,
+  TM_BAD_JSON_COUNT,
+  TM_BAD_BINARY_COUNT,
+  TM_MOTOR_QUEUE_ERROR_CNT,
+  TM_SET_MAG_MB_ERR_CNT,
+  TM_MAG_CFG_ERR_CNT,
+  TM_DANCE_SERVER_TIME,
+  TM_DANCE_SERVER_TIME_CALC,
+  TM_MQTT_RX_COUNT,
+  TM_MQTT_INPUB_CB_MAX_US,
+  TM_MQTT_DATA_CB_MAX_US,
+  TM_COMMAND_BACKLOG_MAX,
+  TM_COMMAND_DROP_CNT,
+  TM_MQTT_PAYLOAD_OVERFLOW_CNT,
+  TM_STOP_DROP_CNT,
+  TM_DUPLICATE_CMD_CNT,
+  TM_STALE_CMD_CNT,
+  TM_CHOREOGRAPHY_REJECT_CNT,
+  TM_TELEMETRY_SUPPRESSED_CNT,
+  TM_TELEMETRY_SHED_LEVEL,
+  TM_TELEMETRY_SHED_CNT,
+  TM_PUBLISH_SLOT_MS,
+  TM_MAG_STREAM_DROP_CNT,
+  TM_LOG_OVERFLOW_CNT,
+  TM_CORE0_LOAD_PCT,
+  TM_CORE1_LOAD_PCT,
+  TM_HEAP_MIN_FREE_BYTES,
+  NUM_TELEMETRY_METRICS
+};
+
+/*
+ * Telemetry shedding
+ *
+ * Raised at once when the link is congested, stepped down one level after SHED_RECOVER_S clear.
+ * Reduced drops the every sample QoS 0 metrics and thins the 1 Hz metrics, minimal also drops
+ * the analog housekeeping. Acks and QoS 1 metrics are never shed, commands keep their headroom.
+ */
+enum ShedLevel { SHED_NONE, SHED_REDUCED, SHED_MINIMAL, NUM_SHED_LEVELS };
+
+// The 1 Hz metrics, sampled once and then sent as text or as a binary record
+struct FastTelemetry {
+  struct MagXYZ raw;
+  struct MagXYZ calibrated;
+  double heading;
+  double kasa_rmse;
+  bool rssi_valid;
+  int32_t rssi;
+  uint32_t publish_error_count;
+  int32_t current_dance;
+  uint32_t estop_count;
+  uint32_t estop_cb_to_pwm_us;
+};
+
+// Applies the metric's policy, then adds it to the frame
+void publish_metric(mqtt_client_t *client, enum TelemetryMetric id, double val);
+// Lines outside the policy table, the metric is "<measurement_type>/<name>"
+// Tags are empty or ",<key>=<value>" pairs, fields are "<key>=<value>" pairs separated by commas
+// False if the line was not added
+bool frame_add(mqtt_client_t *client, const char *metric, const char *tags, const char *value,
+               uint8_t qos);
+bool frame_add_fields(mqtt_client_t *client, const char *metric, const char *tags,
+                      const char *fields, uint8_t qos);
+// Sends every line added since the last call as one publish, change only metrics count as sent
+// once lwIP accepts it
+void frame_send(mqtt_client_t *client);
+
+// As text metrics or as the binary record, TELEMETRY_BINARY selects which
+void publish_fast_telemetry_record(mqtt_client_t *client, const struct FastTelemetry *ft);
+
+// Once a second with the 1 Hz sample, also publishes the level
+void update_shed_level(mqtt_client_t *client, const struct FastTelemetry *ft);
+enum ShedLevel get_shed_level();
+// Seconds between 1 Hz samples that are actually sent, longer while shedding
+uint32_t get_fast_telemetry_period_s();
+// True when count lines outside the policy table should be dropped, they are counted as shed
+bool shed_extra_lines(uint32_t count);
+uint32_t get_telemetry_suppressed_count();
+uint32_t get_telemetry_shed_count();
+
+// Little endian packing for the binary payloads
+uint8_t *put_u32_le(uint8_t *out, uint32_t value);
+uint8_t *put_float_le(uint8_t *out, double value);
+
+#endif
@@ -0,0 +1,176 @@
+#include <inttypes.h>
+#include <string.h>
+
+#include "FreeRTOS.h"
+
+#include "pico/printf.h"
+#include "pico/stdlib.h"
+
+#include "config.h"
+#include "hardware/sync.h"
+#include "stats.h"
+#include "task.h"
+#include "trace.h"
+
+enum { TRACE_RING_DEPTH = 512, TRACE_CORES = 2 };
+
+struct TraceRecord {
+  uint32_t time_us;
+  uint8_t phase;
+  uint8_t span;
+  uint32_t arg;
+};
+
+// A flight recorder per core, the newest TRACE_RING_DEPTH records of each core are kept
+struct TraceRing {
+  volatile uint32_t head;
+  struct TraceRecord records[TRACE_RING_DEPTH];
+};
+
+// Next record of a dump, a chunk only moves it once the chunk has been sent
+struct TraceDumpPosition {
+  size_t core;
+  uint32_t cursors[TRACE_CORES];
+};
+
+static struct TraceRing trace_rings[TRACE_CORES];
+static volatile bool trace_frozen = false;
+static volatile enum TraceDumpOwner dump_owner = TRACE_DUMP_NONE;
+static struct TraceDumpPosition dump_position;
+static struct TraceDumpPosition next_dump_position;
+static bool next_chunk_last = false;
+
+// Same scheme as the log rings, masking interrupts on this core keeps one producer per ring
+// This function has early exits
+static void trace_record(enum TracePhase phase, uint8_t span, uint32_t arg) {
+  if (!TRACE_ENABLED || trace_frozen) {
+    return;  // Early Exit!
+  }
+
+  uint32_t irq_state = save_and_disable_interrupts();
+  struct TraceRing *ring = &trace_rings[get_core_num()];
+  struct TraceRecord *record = &ring->records[ring->head % TRACE_RING_DEPTH];
+  record->time_us = time_us_32();
+  record->phase = (uint8_t)phase;
+  record->span = span;
+  record->arg = arg;
+  ring->head++;
+  restore_interrupts(irq_state);
+}
+
+void trace_begin(enum TraceSpan span, uint32_t arg) { trace_record(TRACE_BEGIN, span, arg); }
+
+void trace_end(enum TraceSpan span) { trace_record(TRACE_END, span, 0); }
+
+void trace_task_switched_in() {
+  trace_record(TRACE_SWITCH_IN, 0, uxTaskGetTaskNumber(xTaskGetCurrentTaskHandle()));
+}
+
+// This function has early exits
+bool start_trace_dump(enum TraceDumpOwner owner) {
+  if ((owner == TRACE_DUMP_NONE) || (dump_owner != TRACE_DUMP_NONE)) {
+    return false;  // Early Exit!
+  }
+
+  trace_frozen = true;
+  // A record already being written on the other core is finished well before it is read
+  __dmb();
+  for (size_t core = 0; core < TRACE_CORES; core++) {
+    uint32_t head = trace_rings[core].head;
+    dump_position.cursors[core] = (head > TRACE_RING_DEPTH) ? head - TRACE_RING_DEPTH : 0;
+  }
+  dump_position.core = 0;
+  next_dump_position = dump_position;
+  next_chunk_last = false;
+  // The position must be set before the owner can see the dump
+  __dmb();
+  dump_owner = owner;
+  return true;
+}
+
+enum TraceDumpOwner get_trace_dump_owner() { return dump_owner; }
+
+static uint8_t *put_u32_le(uint8_t *out, uint32_t value) {
+  out[0] = (uint8_t)value;
+  out[1] = (uint8_t)(value >> 8);
+  out[2] = (uint8_t)(value >> 16);
+  out[3] = (uint8_t)(value >> 24);
+  return out + 4;
+}
+
+// Always builds the chunk at the committed position, so a chunk that failed to send is rebuilt
+size_t read_trace_chunk(uint8_t *chunk) {
+  struct TraceDumpPosition position = dump_position;
+  uint8_t *out = &chunk[TRACE_CHUNK_HEADER_SIZE];
+  uint8_t count = 0;
+
+  while ((count < TRACE_CHUNK_RECORDS) && (position.core < TRACE_CORES)) {
+    const struct TraceRing *ring = &trace_rings[position.core];
+    uint32_t *cursor = &position.cursors[position.core];
+    if (*cursor == ring->head) {
+      position.core++;
+      continue;
+    }
+    const struct TraceRecord *record = &ring->records[*cursor % TRACE_RING_DEPTH];
+    out = put_u32_le(out, record->time_us);
+    *out++ = (uint8_t)position.core;
+    *out++ = record->phase;
+    *out++ = record->span;
+    *out++ = 0;
+    out = put_u32_le(out, record->arg);
+    (*cursor)++;
+    count++;
+  }
+
+  next_dump_position = position;
+  next_chunk_last = (position.core >= TRACE_CORES);
+  chunk[0] = TRACE_CHUNK_VERSION;
+  chunk[1] = (uint8_t)DUCK_ID_NUM;
+  chunk[2] = next_chunk_last ? TRACE_CHUNK_LAST : 0;
+  chunk[3] = count;
+  return (size_t)(out - chunk);
+}
+
+void commit_trace_chunk() {
+  dump_position = next_dump_position;
+  if (next_chunk_last) {
+    dump_owner = TRACE_DUMP_NONE;
+    trace_frozen = false;
+  }
+}
+
+size_t format_trace_task_names(char *buffer, size_t size) {
+  size_t len = 0;
+  const char *name;
+  for (uint32_t number = 1; (name = get_task_stats_name(number)) != NULL; number++) {
+    int written = snprintf(&buffer[len], size - len, "%" PRIu32 " %s\n", number, name);
+    if ((written < 0) || ((size_t)written >= size - len)) {
+      break;
+    }
+    len += (size_t)written;
+  }
+  return len;
+}
+
+// This function has early exits
+void print_trace_chunk() {
+  static uint8_t chunk[TRACE_CHUNK_MAX_SIZE];
+
+  if (get_trace_dump_owner() != TRACE_DUMP_UART) {
+    return;  // Early Exit!
+  }
+  size_t len = read_trace_chunk(chunk);
+  printf("TRACE ");
+  for (size_t i = 0; i < len; i++) {
+    printf("%02x", chunk[i]);
+  }
+  printf("\n");
+  commit_trace_chunk();
+  if (get_trace_dump_owner() == TRACE_DUMP_UART) {
+    return;  // Early Exit!
+  }
+
+  static char names[512];
+  format_trace_task_names(names, sizeof(names));
+  printf("TRACE_TASKS\n%sTRACE_END\n", names);
+}
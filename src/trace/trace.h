@@ -0,0 +1,66 @@
+#ifndef _DD_TRACE_H
+#define _DD_TRACE_H
+
+// Included from FreeRTOSConfig.h for the trace hooks, so no FreeRTOS headers here
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Spans on the hot paths, recorded as a begin and an end
+enum TraceSpan {
+  TRACE_MOTOR_LOOP,
+  TRACE_MAG_READ,
+  TRACE_MQTT_INPUB_CB,
+  TRACE_MQTT_DATA_CB,
+  TRACE_COMMAND,
+  TRACE_PUBLISH_SLOT,
+  NUM_TRACE_SPANS
+};
+
+enum TracePhase { TRACE_BEGIN, TRACE_END, TRACE_SWITCH_IN };
+
+// Never blocks, safe from any task or interrupt on either core, the oldest record is overwritten
+void trace_begin(enum TraceSpan span, uint32_t arg);
+void trace_end(enum TraceSpan span);
+// Called by traceTASK_SWITCHED_IN, records the task number set by register_task_stats
+void trace_task_switched_in();
+
+// Only the owner of a dump reads it, the UART dump is printed by the log task, MQTT by publish
+enum TraceDumpOwner { TRACE_DUMP_NONE, TRACE_DUMP_UART, TRACE_DUMP_MQTT };
+
+// Recording pauses from the start of a dump until its last chunk is committed
+// False while another dump is in progress
+bool start_trace_dump(enum TraceDumpOwner owner);
+enum TraceDumpOwner get_trace_dump_owner();
+
+/*
+ * Trace chunk, version 1, little endian
+ *
+ * uint8_t version
+ * uint8_t duck_id
+ * uint8_t flags      TRACE_CHUNK_LAST on the final chunk of a dump
+ * uint8_t count      Records in this chunk
+ * count times
+ *   uint32_t time_us
+ *   uint8_t core
+ *   uint8_t phase    enum TracePhase
+ *   uint8_t span     enum TraceSpan, 0 for TRACE_SWITCH_IN
+ *   uint8_t reserved
+ *   uint32_t arg     Task number for TRACE_SWITCH_IN
+ *
+ * Decoded by python/trace_to_perfetto.py
+ */
+enum { TRACE_CHUNK_VERSION = 1, TRACE_CHUNK_LAST = 0x01 };
+enum { TRACE_CHUNK_HEADER_SIZE = 4, TRACE_RECORD_SIZE = 12, TRACE_CHUNK_RECORDS = 80 };
+enum { TRACE_CHUNK_MAX_SIZE = TRACE_CHUNK_HEADER_SIZE + TRACE_CHUNK_RECORDS * TRACE_RECORD_SIZE };
+
+// Fills the next chunk of the dump in progress, returns its size
+// The same chunk is filled again until commit_trace_chunk(), call that once it has been sent
+size_t read_trace_chunk(uint8_t *chunk);
+void commit_trace_chunk();
+// "<number> <name>" lines for the task numbers in TRACE_SWITCH_IN records
+size_t format_trace_task_names(char *buffer, size_t size);
+// Prints the next chunk of a UART dump as "TRACE <hex chunk>", the last adds "TRACE_TASKS" names
+void print_trace_chunk();
+
+#endif
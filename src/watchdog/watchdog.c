@@ -7,6 +7,7 @@
 
 #include "config.h"
 #include "hardware/watchdog.h"
+#include "log.h"
 #include "task.h"
 
 static const uint32_t TOGGLE_PIN_1 = 14;
@@ -21,7 +22,7 @@ void vWatchDogTask() {
     if (!DEBUG_IDLE) {
       // Normal Operation
       if (counter % 10 == 0) {
-        printf("Pet Watchdog\n");
+        log_event(LOG_PET_WATCHDOG, 0, 0, 0);
       }
       counter++;
       vTaskDelay(WATCHDOG_DELAY_MS);
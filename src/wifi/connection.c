@@ -0,0 +1,326 @@
+#include <inttypes.h>
+
+#include "FreeRTOS.h"
+
+#include "pico/cyw43_arch.h"
+#include "pico/rand.h"
+#include "pico/stdlib.h"
+
+#include "lwip/apps/mqtt.h"
+
+#include "config.h"
+#include "connection.h"
+#include "mqtt.h"
+#include "task.h"
+#include "timers.h"
+
+struct AccessPoint {
+  const char *ssid;
+  const char *password;
+};
+
+enum { NUM_ACCESS_POINTS = 2, NUM_BROKERS = 2 };
+
+static const struct AccessPoint ACCESS_POINTS[NUM_ACCESS_POINTS] = {
+    {WIFI_SSID, WIFI_PASSWORD},
+    {WIFI_SSID_ALT, WIFI_PASSWORD_ALT},
+};
+
+static const uint8_t BROKER_IPS[NUM_BROKERS][4] = {
+    {MQTT_BROKER_IP_A, MQTT_BROKER_IP_B, MQTT_BROKER_IP_C, MQTT_BROKER_IP_D},
+    {MQTT_BROKER_IP_A_ALT, MQTT_BROKER_IP_B_ALT, MQTT_BROKER_IP_C_ALT, MQTT_BROKER_IP_D_ALT},
+};
+
+// MQTT reconnects are paced by a one shot timer, every transition runs in the connection task
+enum MqttState {
+  MQTT_OFFLINE,     // No Wi-Fi
+  MQTT_WAITING,     // Timer runs until the next connect attempt
+  MQTT_CONNECTING,  // Timer runs until the attempt is abandoned
+  MQTT_ONLINE,
+};
+
+enum MqttEvent {
+  WIFI_UP_EVENT,
+  WIFI_DOWN_EVENT,
+  ACCEPTED_EVENT,
+  LOST_EVENT,
+  TIMER_EVENT,
+};
+
+// Events from other tasks are notification bits, setting a bit cannot fail or overflow
+static const uint32_t ACCEPTED_BIT = 0x01;
+static const uint32_t LOST_BIT = 0x02;
+static const uint32_t TIMER_BIT = 0x04;
+
+// Candidates are tried starting from the last pair that worked
+static uint32_t ap_index = 0;
+static uint32_t broker_index = 0;
+
+static struct ConnectionTaskParameters *mqtt_target = NULL;
+static TaskHandle_t connection_task = NULL;
+static TimerHandle_t reconnect_timer = NULL;
+static TickType_t reconnect_deadline = 0;
+static enum MqttState mqtt_state = MQTT_OFFLINE;
+static uint32_t broker_failures = 0;
+
+static bool ever_connected = false;
+static bool offline = false;
+static uint32_t offline_since_ms = 0;
+static uint32_t offline_report_ms = 0;  // 0 when there is nothing to report
+static uint32_t reconnect_count = 0;
+static uint32_t downtime_ms = 0;
+
+bool get_offline_report(uint32_t *offline_ms) {
+  *offline_ms = offline_report_ms;
+  offline_report_ms = 0;
+  return *offline_ms != 0;
+}
+
+uint32_t get_wifi_ap_index() { return ap_index; }
+
+uint32_t get_mqtt_broker_index() { return broker_index; }
+
+uint32_t get_mqtt_reconnect_count() { return reconnect_count; }
+
+uint32_t get_mqtt_downtime_ms() { return downtime_ms; }
+
+static uint32_t now_ms() { return xTaskGetTickCount() * portTICK_PERIOD_MS; }
+
+// Outages are counted from the first connection, not from boot
+static void mark_offline() {
+  if (ever_connected && !offline) {
+    offline = true;
+    offline_since_ms = now_ms();
+  }
+}
+
+static void mark_online() {
+  if (offline) {
+    offline = false;
+    uint32_t offline_ms = now_ms() - offline_since_ms;
+    downtime_ms += offline_ms;
+    reconnect_count++;
+    offline_report_ms = (offline_ms > 0) ? offline_ms : 1;
+    printf("Back online after %" PRIu32 "ms\n", offline_ms);
+  }
+  ever_connected = true;
+}
+
+// Exponential backoff with jitter, so ducks that lost the same AP or broker do not retry in step
+static uint32_t backoff_ms(uint32_t *failures) {
+  uint32_t shift = (*failures < 16) ? *failures : 16;
+  uint32_t ceiling_ms = CONNECT_BACKOFF_MIN_MS << shift;
+  if (ceiling_ms > CONNECT_BACKOFF_MAX_MS) {
+    ceiling_ms = CONNECT_BACKOFF_MAX_MS;
+  }
+  (*failures)++;
+  return ceiling_ms / 2 + get_rand_32() % (ceiling_ms / 2 + 1);
+}
+
+// The deadline also covers a timer command that could not be queued, see is_deadline_passed()
+static void start_reconnect_timer(uint32_t delay_ms) {
+  TickType_t period = pdMS_TO_TICKS(delay_ms) + 1;
+  reconnect_deadline = xTaskGetTickCount() + period;
+  if (xTimerChangePeriod(reconnect_timer, period, 0) != pdPASS) {
+    printf("MQTT Reconnect Timer start failed\n");
+  }
+}
+
+// A timer bit left over from an earlier period is ignored
+static bool is_deadline_passed() {
+  return (int32_t)(xTaskGetTickCount() - reconnect_deadline) >= 0;
+}
+
+static void schedule_connect() {
+  uint32_t delay_ms = backoff_ms(&broker_failures);
+  printf("MQTT connect to broker %" PRIu32 " in %" PRIu32 "ms\n", broker_index, delay_ms);
+  mqtt_state = MQTT_WAITING;
+  start_reconnect_timer(delay_ms);
+}
+
+static void connect_failed() {
+  mqtt_drop_connection(mqtt_target->client);
+  broker_index = (broker_index + 1) % NUM_BROKERS;
+  schedule_connect();
+}
+
+// This function has early exits
+static void start_connect() {
+  const uint8_t *ip = BROKER_IPS[broker_index];
+  ip_addr_t broker;
+  IP4_ADDR(&broker, ip[0], ip[1], ip[2], ip[3]);
+
+  if (mqtt_connect(mqtt_target->client, mqtt_target->mqtt_params, &broker) != ERR_OK) {
+    connect_failed();
+    return;  // Early Exit!
+  }
+
+  mqtt_state = MQTT_CONNECTING;
+  start_reconnect_timer(MQTT_CONNECT_TIMEOUT_MS);
+}
+
+// Runs in the connection task
+// This function has early exits
+static void handle_mqtt_event(enum MqttEvent event) {
+  if ((event == TIMER_EVENT) && !is_deadline_passed()) {
+    return;  // Early Exit!
+  }
+
+  if (event == WIFI_DOWN_EVENT) {
+    xTimerStop(reconnect_timer, 0);
+    if (mqtt_state != MQTT_OFFLINE) {
+      mqtt_drop_connection(mqtt_target->client);
+    }
+    mark_offline();
+    mqtt_state = MQTT_OFFLINE;
+    return;  // Early Exit!
+  }
+
+  switch (mqtt_state) {
+    case MQTT_OFFLINE:
+      if (event == WIFI_UP_EVENT) {
+        // The first attempt is jittered too, so ducks sharing an AP do not reconnect at once
+        broker_failures = 0;
+        schedule_connect();
+      }
+      break;
+    case MQTT_WAITING:
+      if (event == TIMER_EVENT) {
+        start_connect();
+      }
+      break;
+    case MQTT_CONNECTING:
+      if (event == ACCEPTED_EVENT) {
+        xTimerStop(reconnect_timer, 0);
+        mqtt_state = MQTT_ONLINE;
+        mark_online();
+      } else if ((event == LOST_EVENT) || (event == TIMER_EVENT)) {
+        printf("MQTT broker %" PRIu32 " did not accept\n", broker_index);
+        connect_failed();
+      }
+      break;
+    case MQTT_ONLINE:
+      if (event == LOST_EVENT) {
+        mark_offline();
+        broker_failures = 0;
+        schedule_connect();
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+// Runs in the timer task, only wakes the connection task
+static void reconnect_timer_cb(TimerHandle_t timer) {
+  (void)timer;
+  xTaskNotify(connection_task, TIMER_BIT, eSetBits);
+}
+
+void notify_mqtt_connection(bool accepted) {
+  if (connection_task) {
+    xTaskNotify(connection_task, accepted ? ACCEPTED_BIT : LOST_BIT, eSetBits);
+  }
+}
+
+// Waits up to wait_ms for events, an accept is handled before a loss that followed it
+// This function has early exits
+static void wait_mqtt_events(uint32_t wait_ms) {
+  uint32_t bits = 0;
+  xTaskNotifyWait(0, UINT32_MAX, &bits, pdMS_TO_TICKS(wait_ms));
+  if (mqtt_target == NULL) {
+    return;  // Early Exit!
+  }
+
+  if (bits & ACCEPTED_BIT) {
+    handle_mqtt_event(ACCEPTED_EVENT);
+  }
+  if (bits & LOST_BIT) {
+    handle_mqtt_event(LOST_EVENT);
+  }
+  if ((bits & TIMER_BIT) ||
+      (((mqtt_state == MQTT_WAITING) || (mqtt_state == MQTT_CONNECTING)) &&
+       is_deadline_passed())) {
+    handle_mqtt_event(TIMER_EVENT);
+  }
+}
+
+static void post_wifi_event(enum MqttEvent event) {
+  if (mqtt_target) {
+    handle_mqtt_event(event);
+  }
+}
+
+static bool is_wifi_up() {
+  return cyw43_tcpip_link_status(&cyw43_state, CYW43_ITF_STA) == CYW43_LINK_UP;
+}
+
+// Skips an ALT access point that was not configured
+static uint32_t next_access_point(uint32_t index) {
+  uint32_t next = (index + 1) % NUM_ACCESS_POINTS;
+  return (ACCESS_POINTS[next].ssid[0] != '\0') ? next : index;
+}
+
+// This function has early exits
+static bool connect_access_point() {
+  const struct AccessPoint *ap = &ACCESS_POINTS[ap_index];
+
+  printf("Connecting to Wi-Fi %" PRIu32 "...\n", ap_index);
+  if (PRINT_WIFI_CREDS) {
+    printf("WiFi SSID: %s\n", ap->ssid);
+    printf("WiFI Password: %s\n", ap->password);
+  }
+
+  if (cyw43_arch_wifi_connect_timeout_ms(ap->ssid, ap->password, CYW43_AUTH_WPA2_AES_PSK,
+                                         WIFI_TIMEOUT_MS)) {
+    printf("failed to connect to wifi.\n");
+    return false;  // Early Exit!
+  }
+
+  printf("Connected.\n");
+  return true;
+}
+
+// Joining an access point blocks, MQTT events wait until it returns and are then handled here
+void vConnectionTask(void *pvParameters) {
+  struct ConnectionTaskParameters *ctp = (struct ConnectionTaskParameters *)pvParameters;
+  uint32_t wifi_failures = 0;
+  bool wifi_up = false;
+
+  connection_task = xTaskGetCurrentTaskHandle();
+  if (ctp->client) {
+    reconnect_timer = xTimerCreate("MQTT Reconnect", 1, pdFALSE, NULL, reconnect_timer_cb);
+    if (reconnect_timer) {
+      mqtt_target = ctp;
+    } else {
+      printf("MQTT Reconnect Timer Creation Failed!\n");
+    }
+  }
+
+  for (;;) {
+    if (is_wifi_up()) {
+      if (!wifi_up) {
+        wifi_up = true;
+        wifi_failures = 0;
+        post_wifi_event(WIFI_UP_EVENT);
+      }
+      wait_mqtt_events(LINK_CHECK_INTERVAL_MS);
+      continue;
+    }
+
+    if (wifi_up) {
+      wifi_up = false;
+      post_wifi_event(WIFI_DOWN_EVENT);
+      // Events from the dropped connection are stale
+      xTaskNotifyStateClear(NULL);
+      ulTaskNotifyValueClear(NULL, UINT32_MAX);
+    }
+
+    if (!connect_access_point()) {
+      ap_index = next_access_point(ap_index);
+      uint32_t delay_ms = backoff_ms(&wifi_failures);
+      printf("Wi-Fi retry in %" PRIu32 "ms\n", delay_ms);
+      vTaskDelay(pdMS_TO_TICKS(delay_ms));
+    }
+  }
+}
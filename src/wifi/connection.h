@@ -0,0 +1,33 @@
+#ifndef _DD_CONNECTION_H
+#define _DD_CONNECTION_H
+
+#include <stdbool.h>
+
+#include "lwip/apps/mqtt.h"
+
+#include "mqtt.h"
+#include "stdint.h"
+
+struct ConnectionTaskParameters {
+  mqtt_client_t *client;             // NULL to only keep Wi-Fi up, as in PING mode
+  struct MqttParameters *mqtt_params;
+};
+
+// Called from the MQTT connection callback, the connection task takes it from there
+void notify_mqtt_connection(bool accepted);
+
+// Time the last outage lasted, true only on the first read after the link returns
+bool get_offline_report(uint32_t *offline_ms);
+
+// Index into the primary and ALT credentials in use, 0 is primary
+uint32_t get_wifi_ap_index();
+uint32_t get_mqtt_broker_index();
+// Reconnects after an outage, and the total time they took
+uint32_t get_mqtt_reconnect_count();
+uint32_t get_mqtt_downtime_ms();
+
+// Keeps Wi-Fi and the MQTT broker connected, failing over to the ALT credentials with backoff
+// Reconnects to MQTT run in this task, so no callback reconnects recursively
+void vConnectionTask(void *pvParameters);
+
+#endif
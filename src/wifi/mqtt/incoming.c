@@ -0,0 +1,208 @@
+#include <stddef.h>
+#include <string.h>
+
+#include "FreeRTOS.h"
+
+#include "pico/printf.h"
+#include "pico/stdlib.h"
+
+#include "lwip/apps/mqtt.h"
+
+#include "config.h"
+#include "incoming.h"
+#include "latency.h"
+#include "log.h"
+#include "message_buffer.h"
+#include "mqtt.h"
+#include "task.h"
+#include "topics.h"
+#include "trace.h"
+
+static const bool DEBUG_PRINT = false;
+static uint32_t mqtt_rx_count = 0;
+static uint32_t inpub_cb_max_us = 0;
+static uint32_t data_cb_max_us = 0;
+
+// Sent is only written by the lwIP callback and processed only by the command task
+static uint32_t command_sent_count = 0;
+static uint32_t command_processed_count = 0;
+static uint32_t command_backlog_max = 0;
+static uint32_t command_drop_count = 0;
+static uint32_t payload_overflow_count = 0;
+static uint32_t stop_drop_count = 0;
+
+uint32_t get_mqtt_rx_count() { return mqtt_rx_count; }
+
+// Maxima are read and reset by the publish task on the other core, a max set in between would be
+// lost
+static uint32_t take_max(uint32_t *max) {
+  taskENTER_CRITICAL();
+  uint32_t value = *max;
+  *max = 0;
+  taskEXIT_CRITICAL();
+  return value;
+}
+
+static void update_max(uint32_t *max, uint32_t value) {
+  taskENTER_CRITICAL();
+  if (value > *max) {
+    *max = value;
+  }
+  taskEXIT_CRITICAL();
+}
+
+uint32_t get_mqtt_inpub_cb_max_us() { return take_max(&inpub_cb_max_us); }
+
+uint32_t get_mqtt_data_cb_max_us() { return take_max(&data_cb_max_us); }
+
+uint32_t get_command_backlog_max() { return take_max(&command_backlog_max); }
+
+uint32_t get_command_drop_count() { return command_drop_count; }
+
+uint32_t get_mqtt_payload_overflow_count() { return payload_overflow_count; }
+
+uint32_t get_stop_drop_count() { return stop_drop_count; }
+
+// Commands are reassembled out of the lwIP callback and handled by the command task
+struct CommandMessage {
+  uint8_t handler;  // get_topic_index()
+  uint32_t received_us;
+  uint8_t payload[MQTT_PAYLOAD_MAX_BYTES];
+};
+
+static const size_t COMMAND_HEADER_SIZE = offsetof(struct CommandMessage, payload);
+
+/* File scoped variables to reassemble the incoming publish in place */
+static const struct TopicHandler *inpub_handler = NULL;
+static uint32_t inpub_received_us;
+static struct CommandMessage inpub_message;
+static size_t inpub_len;
+static bool inpub_overflow;
+
+static void record_max_us(uint32_t *max_us, uint32_t start_us) {
+  update_max(max_us, time_us_32() - start_us);
+}
+
+static void append_fragment(const u8_t *data, u16_t len) {
+  if (inpub_overflow) {
+    return;  // Early Exit!
+  }
+  if (inpub_len + len > sizeof(inpub_message.payload)) {
+    inpub_overflow = true;
+    return;  // Early Exit!
+  }
+  memcpy(&inpub_message.payload[inpub_len], data, len);
+  inpub_len += len;
+}
+
+// A dropped stop_all has still stopped the motors, but not reset the mode and queues
+static void count_dropped_command() {
+  if (is_stop_all_topic(inpub_handler)) {
+    stop_drop_count++;
+  }
+}
+
+static void send_command(struct MqttParameters *mp) {
+  if (inpub_overflow) {
+    log_event(LOG_COMMAND_TOO_LARGE, MQTT_PAYLOAD_MAX_BYTES, 0, 0);
+    payload_overflow_count++;
+    count_dropped_command();
+    return;  // Early Exit!
+  }
+
+  inpub_message.handler = get_topic_index(inpub_handler);
+  inpub_message.received_us = inpub_received_us;
+
+  // Never block the lwIP thread, a full buffer drops the command
+  size_t sent =
+      xMessageBufferSend(mp->command_buffer, &inpub_message, COMMAND_HEADER_SIZE + inpub_len, 0);
+  if (sent == 0) {
+    command_drop_count++;
+    count_dropped_command();
+    return;  // Early Exit!
+  }
+
+  command_sent_count++;
+  update_max(&command_backlog_max, command_sent_count - command_processed_count);
+}
+
+/* Callback for incoming publish */
+static void mqtt_incoming_publish_cb(void *params, const char *topic, u32_t tot_len) {
+  struct MqttParameters *mqtt_params = (struct MqttParameters *)params;
+
+  inpub_received_us = time_us_32();
+  trace_begin(TRACE_MQTT_INPUB_CB, tot_len);
+
+  if (DEBUG_PRINT) {
+    printf("Incoming publish at topic %s with total length %u\n", topic, (unsigned int)tot_len);
+  }
+
+  mqtt_rx_count++;
+
+  inpub_len = 0;
+  inpub_overflow = (tot_len > MQTT_PAYLOAD_MAX_BYTES);
+
+  inpub_handler = resolve_topic(topic);
+  if (inpub_handler && inpub_handler->on_start) {
+    inpub_handler->on_start(mqtt_params, tot_len, inpub_received_us);
+  }
+
+  record_max_us(&inpub_cb_max_us, inpub_received_us);
+  trace_end(TRACE_MQTT_INPUB_CB);
+}
+
+/* Callback for incoming data, payloads larger than the rx buffer arrive in several calls */
+static void mqtt_incoming_data_cb(void *params, const u8_t *data, u16_t len, u8_t flags) {
+  uint32_t start_us = time_us_32();
+  trace_begin(TRACE_MQTT_DATA_CB, len);
+
+  if (DEBUG_PRINT) {
+    printf("Incoming publish payload with length %d, flags %u\n", len, (unsigned int)flags);
+    printf("Payload: %s\n", (char *)data);
+  }
+
+  struct MqttParameters *mqtt_params = (struct MqttParameters *)params;
+  bool last = (flags & MQTT_DATA_FLAG_LAST);
+
+  if (inpub_handler == NULL) {
+    if (last) {
+      log_event(LOG_PAYLOAD_IGNORED, 0, 0, 0);
+    }
+  } else {
+    append_fragment(data, len);
+    if (last) {
+      send_command(mqtt_params);
+    }
+  }
+
+  record_max_us(&data_cb_max_us, start_us);
+  record_latency(LATENCY_MQTT_DATA_CB, time_us_32() - start_us);
+  trace_end(TRACE_MQTT_DATA_CB);
+}
+
+void set_incoming_callbacks(mqtt_client_t *client, void *params) {
+  build_topic_prefixes();
+  mqtt_set_inpub_callback(client, mqtt_incoming_publish_cb, mqtt_incoming_data_cb, params);
+}
+
+/**** Command Task ****/
+
+void vCommandTask(void *pvParameters) {
+  struct MqttParameters *mp = (struct MqttParameters *)pvParameters;
+  static struct CommandMessage message;
+
+  for (;;) {
+    size_t size =
+        xMessageBufferReceive(mp->command_buffer, &message, sizeof(message), portMAX_DELAY);
+    const struct TopicHandler *handler = get_topic_handler(message.handler);
+    if ((size < COMMAND_HEADER_SIZE) || (handler == NULL)) {
+      continue;
+    }
+
+    command_processed_count++;
+    log_event(LOG_COMMAND_RECEIVED, (uint32_t)(uintptr_t)handler->suffix, 0, 0);
+    trace_begin(TRACE_COMMAND, message.handler);
+    handler->on_data(mp, message.payload, size - COMMAND_HEADER_SIZE, message.received_us);
+    trace_end(TRACE_COMMAND);
+  }
+}
@@ -0,0 +1,26 @@
+#ifndef _DD_INCOMING_H
+#define _DD_INCOMING_H
+
+#include "lwip/apps/mqtt.h"
+
+#include "stdint.h"
+
+// Matches each incoming publish to its topic handler and reassembles the payload for the command
+// task, set on every connect
+void set_incoming_callbacks(mqtt_client_t *client, void *params);
+
+uint32_t get_mqtt_rx_count();
+// Worst time spent matching a topic in the incoming publish callback since the last read
+uint32_t get_mqtt_inpub_cb_max_us();
+uint32_t get_mqtt_data_cb_max_us();
+// Most commands waiting for the command task since the last read
+uint32_t get_command_backlog_max();
+uint32_t get_command_drop_count();
+// Publishes dropped for exceeding MQTT_PAYLOAD_MAX_BYTES once reassembled
+uint32_t get_mqtt_payload_overflow_count();
+uint32_t get_stop_drop_count();  // stop_all commands that never reached the command task
+
+// Parses and dispatches commands copied out of the MQTT callbacks
+void vCommandTask(void *pvParameters);
+
+#endif
@@ -1,23 +1,34 @@
 #ifndef _DD_MQTT_H
 #define _DD_MQTT_H
 
+#include <stdbool.h>
+
 #include "lwip/apps/mqtt.h"
 #include "lwip/apps/mqtt_priv.h"
 
+#include "message_buffer.h"
 #include "queue.h"
 #include "semphr.h"
 
 #define DANCING_DUCK_SUBSCRIPTION ("dancing_duck")
 
 struct MqttParameters {
-  QueueHandle_t motor_queue;
+  QueueHandle_t override_queue;
+  QueueHandle_t corrective_mailbox;
   QueueHandle_t duck_mode_mailbox;
   QueueHandle_t wind_mailbox;
   SemaphoreHandle_t motor_stop;
   SemaphoreHandle_t calibrate;
+  MessageBufferHandle_t command_buffer;
+  QueueHandle_t ack_queue;
 };
 
-err_t mqtt_connect(mqtt_client_t *client, void *arg);
-uint32_t get_mqtt_rx_count();
+err_t mqtt_connect(mqtt_client_t *client, void *arg, const ip_addr_t *broker);
+// True from the broker accepting the connection until it is lost
+bool is_mqtt_connected();
+void mqtt_drop_connection(mqtt_client_t *client);
+
+// Subscribe to groups joined and unsubscribe from groups left, applied on connect if offline
+void update_group_subscriptions(uint32_t old_mask, uint32_t new_mask);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,271 @@
+#include <stddef.h>
+#include <string.h>
+
+#include "FreeRTOS.h"
+
+#include "pico/printf.h"
+#include "pico/stdlib.h"
+
+#include "lwip/apps/mqtt.h"
+
+#include "choreography.h"
+#include "commanding.h"
+#include "config.h"
+#include "dance_time.h"
+#include "groups.h"
+#include "magnetometer.h"
+#include "motor.h"
+#include "mqtt.h"
+#include "picowota/reboot.h"
+#include "reboot.h"
+#include "topics.h"
+#include "trace.h"
+
+enum { TOPIC_PREFIX_BYTES = 128 };
+
+// Which subscription roots a command topic is accepted on
+enum TopicRoot {
+  DEVICE_ROOT = 0x01,  // dancing_duck/devices/<id>/command/
+  ALL_ROOT = 0x02,     // dancing_duck/all_devices/command/
+  GROUP_ROOT = 0x04,   // dancing_duck/groups/<g>/command/
+};
+
+static void handle_uart_tx(struct MqttParameters *mp, const u8_t *data, u16_t len,
+                           uint32_t received_us) {
+  (void)mp;
+  (void)received_us;
+  if ((len > 0) && (data[len - 1] == 0)) {
+    printf("UART Test: %s\n", (const char *)data);
+  } else {
+    printf("Termination check failed \n");
+  }
+}
+
+static void handle_calibrate(struct MqttParameters *mp, const u8_t *data, u16_t len,
+                             uint32_t received_us) {
+  (void)data;
+  (void)len;
+  enqueue_calibrate_command(mp, received_us);
+}
+
+// Payload is the stream duration in seconds as ASCII, empty for the default
+static void handle_mag_stream(struct MqttParameters *mp, const u8_t *data, u16_t len,
+                              uint32_t received_us) {
+  (void)mp;
+  (void)received_us;
+  uint32_t duration_s = 0;
+  for (u16_t i = 0; (i < len) && (data[i] >= '0') && (data[i] <= '9'); i++) {
+    duration_s = duration_s * 10 + (uint32_t)(data[i] - '0');
+    if (duration_s > MAG_STREAM_MAX_S) {
+      duration_s = MAG_STREAM_MAX_S;
+      break;
+    }
+  }
+  start_mag_stream(duration_s);
+}
+
+// Payload "uart" prints the trace from the log task, else it is published
+static void handle_trace_dump(struct MqttParameters *mp, const u8_t *data, u16_t len,
+                              uint32_t received_us) {
+  (void)mp;
+  (void)received_us;
+  if ((len == 4) && (memcmp(data, "uart", 4) == 0)) {
+    start_trace_dump(TRACE_DUMP_UART);
+  } else {
+    start_trace_dump(TRACE_DUMP_MQTT);
+  }
+}
+
+static void handle_launch(struct MqttParameters *mp, const u8_t *data, u16_t len,
+                          uint32_t received_us) {
+  enqueue_launch_command(mp, (const char *)data, len, received_us);
+}
+
+static void handle_dance(struct MqttParameters *mp, const u8_t *data, u16_t len,
+                         uint32_t received_us) {
+  (void)data;
+  (void)len;
+  set_dance_mode(mp, received_us);
+}
+
+static void handle_motor(struct MqttParameters *mp, const u8_t *data, u16_t len,
+                         uint32_t received_us) {
+  enqueue_motor_command(mp, (const char *)data, len, received_us);
+}
+
+// Stop cuts the motors as soon as the topic is matched, before any payload or printf
+// The motor task is told here too, its queued command may be dropped and it clears the latch
+static void start_stop_all(struct MqttParameters *mp, uint32_t tot_len, uint32_t received_us) {
+  (void)tot_len;
+  emergency_stop_motors(received_us);
+  request_motor_stop(mp->motor_stop, received_us);
+}
+
+static void handle_motor_binary(struct MqttParameters *mp, const u8_t *data, u16_t len,
+                                uint32_t received_us) {
+  enqueue_motor_command_binary(mp, data, len, received_us);
+}
+
+static void handle_sequence(struct MqttParameters *mp, const u8_t *data, u16_t len,
+                            uint32_t received_us) {
+  enqueue_motor_sequence(mp, data, len, received_us);
+}
+
+static void handle_stop_all(struct MqttParameters *mp, const u8_t *data, u16_t len,
+                            uint32_t received_us) {
+  (void)data;
+  (void)len;
+  set_stop_mode(mp, received_us);
+}
+
+static void handle_set_time(struct MqttParameters *mp, const u8_t *data, u16_t len,
+                            uint32_t received_us) {
+  (void)mp;
+  set_dance_server_time_ms((const char *)data, len, received_us);
+}
+
+static void handle_set_wind(struct MqttParameters *mp, const u8_t *data, u16_t len,
+                            uint32_t received_us) {
+  (void)received_us;
+  set_wind_config(mp, (const char *)data, len);
+}
+
+static void handle_reset(struct MqttParameters *mp, const u8_t *data, u16_t len,
+                         uint32_t received_us) {
+  (void)mp;
+  (void)data;
+  (void)len;
+  (void)received_us;
+  printf("Reboot Command received\n");
+  reboot(MQTT_COMMANDED_REASON);
+}
+
+static void handle_bootloader(struct MqttParameters *mp, const u8_t *data, u16_t len,
+                              uint32_t received_us) {
+  (void)mp;
+  (void)received_us;
+  printf("Bootloader Command Received\n");
+  printf("Data: %u", *data);
+  if (len >= 1 && *data == 0x42) {
+    // Put device into wireless OTA state
+    printf("OTA Reboot!\n");
+    sleep_ms(50);
+    picowota_reboot(true);
+  }
+}
+
+static void handle_groups(struct MqttParameters *mp, const u8_t *data, u16_t len,
+                          uint32_t received_us) {
+  (void)received_us;
+  set_group_membership(mp, (const char *)data, len);
+}
+
+static void handle_choreography(struct MqttParameters *mp, const u8_t *data, u16_t len,
+                                uint32_t received_us) {
+  (void)mp;
+  (void)received_us;
+  choreography_load(data, len);
+}
+
+static const struct TopicHandler TOPIC_HANDLERS[] = {
+    {"stop_all", DEVICE_ROOT | ALL_ROOT | GROUP_ROOT, start_stop_all, handle_stop_all},
+    {"uart_tx", ALL_ROOT, NULL, handle_uart_tx},
+    {"calibrate", DEVICE_ROOT, NULL, handle_calibrate},
+    {"mag_stream", DEVICE_ROOT, NULL, handle_mag_stream},
+    {"trace_dump", DEVICE_ROOT, NULL, handle_trace_dump},
+    {"launch", DEVICE_ROOT, NULL, handle_launch},
+    {"dance", DEVICE_ROOT | GROUP_ROOT, NULL, handle_dance},
+    {"motor", DEVICE_ROOT | GROUP_ROOT, NULL, handle_motor},
+    {"motor/bin", DEVICE_ROOT | GROUP_ROOT, NULL, handle_motor_binary},
+    {"sequence", DEVICE_ROOT | ALL_ROOT | GROUP_ROOT, NULL, handle_sequence},
+    {"set_time", ALL_ROOT, NULL, handle_set_time},
+    {"set_wind", ALL_ROOT, NULL, handle_set_wind},
+    {"reset", DEVICE_ROOT, NULL, handle_reset},
+    {"bootloader", DEVICE_ROOT, NULL, handle_bootloader},
+    {"groups", DEVICE_ROOT, NULL, handle_groups},
+    {"choreography", DEVICE_ROOT | ALL_ROOT, NULL, handle_choreography},
+};
+
+static const size_t NUM_TOPIC_HANDLERS = sizeof(TOPIC_HANDLERS) / sizeof(TOPIC_HANDLERS[0]);
+
+// Subscription roots, built once at connect time
+struct TopicPrefix {
+  char topic[TOPIC_PREFIX_BYTES];
+  size_t len;
+  uint8_t root;
+};
+
+static struct TopicPrefix topic_prefixes[3];
+
+void build_topic_prefixes() {
+  snprintf(topic_prefixes[0].topic, TOPIC_PREFIX_BYTES, "%s/devices/%d/command/",
+           DANCING_DUCK_SUBSCRIPTION, DUCK_ID_NUM);
+  topic_prefixes[0].len = strlen(topic_prefixes[0].topic);
+  topic_prefixes[0].root = DEVICE_ROOT;
+
+  snprintf(topic_prefixes[1].topic, TOPIC_PREFIX_BYTES, "%s/all_devices/command/",
+           DANCING_DUCK_SUBSCRIPTION);
+  topic_prefixes[1].len = strlen(topic_prefixes[1].topic);
+  topic_prefixes[1].root = ALL_ROOT;
+
+  snprintf(topic_prefixes[2].topic, TOPIC_PREFIX_BYTES, "%s/groups/", DANCING_DUCK_SUBSCRIPTION);
+  topic_prefixes[2].len = strlen(topic_prefixes[2].topic);
+  topic_prefixes[2].root = GROUP_ROOT;
+}
+
+// Skip "<g>/command/", NULL if this duck is not in group g
+static const char *strip_group(const char *topic) {
+  static const char COMMAND_PART[] = "/command/";
+
+  uint32_t group = 0;
+  const char *digit = topic;
+  while ((*digit >= '0') && (*digit <= '9') && (group < MAX_GROUPS)) {
+    group = (group * 10) + (uint32_t)(*digit - '0');
+    digit++;
+  }
+
+  if ((digit == topic) || !is_group_member(group) ||
+      (strncmp(digit, COMMAND_PART, sizeof(COMMAND_PART) - 1) != 0)) {
+    return NULL;
+  }
+  return &digit[sizeof(COMMAND_PART) - 1];
+}
+
+// Split the topic on a known root, then match the remaining suffix
+const struct TopicHandler *resolve_topic(const char *topic) {
+  for (size_t i = 0; i < sizeof(topic_prefixes) / sizeof(topic_prefixes[0]); i++) {
+    const struct TopicPrefix *prefix = &topic_prefixes[i];
+    if ((prefix->len == 0) || (strncmp(topic, prefix->topic, prefix->len) != 0)) {
+      continue;
+    }
+
+    const char *suffix = &topic[prefix->len];
+    if ((prefix->root == GROUP_ROOT) && ((suffix = strip_group(suffix)) == NULL)) {
+      return NULL;
+    }
+    for (size_t j = 0; j < NUM_TOPIC_HANDLERS; j++) {
+      if ((TOPIC_HANDLERS[j].roots & prefix->root) &&
+          (strcmp(suffix, TOPIC_HANDLERS[j].suffix) == 0)) {
+        return &TOPIC_HANDLERS[j];
+      }
+    }
+    return NULL;
+  }
+  return NULL;
+}
+
+uint8_t get_topic_index(const struct TopicHandler *handler) {
+  return (uint8_t)(handler - TOPIC_HANDLERS);
+}
+
+// This function has early exits
+const struct TopicHandler *get_topic_handler(uint8_t index) {
+  if (index >= NUM_TOPIC_HANDLERS) {
+    return NULL;  // Early Exit!
+  }
+  return &TOPIC_HANDLERS[index];
+}
+
+bool is_stop_all_topic(const struct TopicHandler *handler) {
+  return handler->on_start == start_stop_all;
+}
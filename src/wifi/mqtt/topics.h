@@ -0,0 +1,30 @@
+#ifndef _DD_TOPICS_H
+#define _DD_TOPICS_H
+
+#include <stdbool.h>
+
+#include "lwip/apps/mqtt.h"
+
+#include "mqtt.h"
+#include "stdint.h"
+
+// One command topic, accepted under each subscription root in roots
+struct TopicHandler {
+  const char *suffix;
+  uint8_t roots;
+  // Called from the incoming publish callback, before any payload arrives
+  void (*on_start)(struct MqttParameters *mp, uint32_t tot_len, uint32_t received_us);
+  // Called from the command task with the reassembled payload
+  void (*on_data)(struct MqttParameters *mp, const u8_t *data, u16_t len, uint32_t received_us);
+};
+
+// Subscription roots for this duck, built on connect before any publish is matched
+void build_topic_prefixes();
+// NULL if the topic is not a command for this duck
+const struct TopicHandler *resolve_topic(const char *topic);
+// The command task is passed the handler's index, NULL if the index is out of range
+uint8_t get_topic_index(const struct TopicHandler *handler);
+const struct TopicHandler *get_topic_handler(uint8_t index);
+bool is_stop_all_topic(const struct TopicHandler *handler);
+
+#endif